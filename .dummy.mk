@@ -0,0 +1 @@
+# used to let all targets depend on Makefile
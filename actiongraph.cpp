@@ -1,123 +1,375 @@
 #include <vector>
+#include <algorithm>
 #include <cassert>
 #include <memory>
 #include <iostream>
+#include <thread>
+#include <atomic>
+#include <exception>
+#include <stdexcept>
+#include <limits>
+#include <chrono>
+#include <functional>
+#include <unordered_map>
+#include <mutex>
 #include <boost/heap/binomial_heap.hpp>
 #include "actiongraph.hpp"
+#include "parallel.hpp"
 
 using namespace std;
 
+// compares a and b at the indices set in mask
+static bool slices_equal(const vector<size_t>& a, const vector<size_t>& b, const vector<uint64_t>& mask)
+{
+	for (size_t w = 0; w < mask.size(); w++)
+		for (uint64_t bits = mask[w]; bits; bits &= bits - 1)
+		{
+			size_t i = w*64 + size_t(__builtin_ctzll(bits));
+			if (a[i] != b[i])
+				return false;
+		}
+	return true;
+}
+
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wshadow"
 bool ActionGraph::Node::equals(const ActionGraph::Node& other, const Factory* factory) const
-#pragma GCC diagnostic pop
 {
-	if (current_item_type != other.current_item_type)
+	if (current_item_type != other.current_item_type || current_component != other.current_component)
 		return false;
 
-	// all facilities, that can still be found in one of the flowgraphs
-	// which we will consider, must match.
+	// all facilities and edges, that can still be found in one of the
+	// flowgraphs which we will consider, must match. the factory's relevance
+	// masks tell which ones these are, a word at a time.
 	assert(conf.facility_levels.size() == factory->facilities.size());
 	assert(other.conf.facility_levels.size() == factory->facilities.size());
-	for (size_t i=0; i<conf.facility_levels.size(); i++)
+	assert(conf.transport_levels.size() == factory->transport_lines.size());
+	assert(other.conf.transport_levels.size() == factory->transport_lines.size());
+	if (!slices_equal(conf.facility_levels, other.conf.facility_levels,
+			factory->relevant_facilities_mask(current_item_type)))
+		return false;
+	if (!slices_equal(conf.transport_levels, other.conf.transport_levels,
+			factory->relevant_transport_lines_mask(current_item_type)))
+		return false;
+
+	return true;
+}
+#pragma GCC diagnostic pop
+
+static inline uint64_t mix(uint64_t x)
+{
+	// the splitmix64 finalizer
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ull;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebull;
+	x ^= x >> 31;
+	return x;
+}
+
+// hashes exactly what equals() compares, with two independently seeded hashes
+NodeKey ActionGraph::Node::key(const Factory* factory) const
+{
+	uint64_t a = 0x243f6a8885a308d3ull, b = 0x13198a2e03707344ull;
+	auto add = [&](uint64_t value)
+	{
+		a = mix(a ^ value);
+		b = mix(b + value + 0x9e3779b97f4a7c15ull);
+	};
+
+	add(uint64_t(current_item_type));
+	add(current_component);
+	for_each_bit(factory->relevant_facilities_mask(current_item_type),
+		[&](size_t i) { add(conf.facility_levels[i]); });
+	for_each_bit(factory->relevant_transport_lines_mask(current_item_type),
+		[&](size_t i) { add(conf.transport_levels[i]); });
+
+	return NodeKey{a, b | 1}; // {0, 0} marks empty slots in ClosedSet
+}
+
+size_t ActionGraph::SimulationCache::entry_bytes(const ComponentResult& result)
+{
+	// the entry, its node in the index, and the index's bucket
+	return sizeof(Entry) + sizeof(pair<NodeKey, size_t>) + 3*sizeof(void*)
+		+ (result.upgradeable_facilities.capacity() + result.upgradeable_transport_lines.capacity()) * sizeof(size_t);
+}
+
+bool ActionGraph::SimulationCache::lookup(NodeKey key, ComponentResult& result)
+{
+	auto iter = index.find(key);
+	if (iter == index.end())
+		return false;
+	Entry& entry = entries[iter->second];
+	entry.referenced = true;
+	result = entry.result;
+	return true;
+}
+
+void ActionGraph::SimulationCache::evict_one()
+{
+	while (true)
 	{
-		if (factory->facilities[i].most_advanced_item_involved > current_item_type)
+		size_t i = hand;
+		hand = (hand + 1) % entries.size();
+		Entry& entry = entries[i];
+		if (entry.key == NodeKey{0, 0})
+			continue; // already free
+		if (entry.referenced)
+		{
+			entry.referenced = false;
 			continue;
-		else
-			if (conf.facility_levels[i] != other.conf.facility_levels[i])
-				return false;
+		}
+
+		used_bytes -= entry_bytes(entry.result);
+		index.erase(entry.key);
+		entry = Entry{NodeKey{0, 0}, ComponentResult(), false};
+		free_entries.push_back(i);
+		return;
 	}
+}
 
-	// all edges, that can still be found in one of the flowgraphs
-	// which we will consider, must match.
-	assert(conf.transport_levels.size() == factory->transport_lines.size());
-	assert(other.conf.transport_levels.size() == factory->transport_lines.size());
-	for (size_t i=0; i<conf.transport_levels.size(); i++)
+void ActionGraph::SimulationCache::insert(NodeKey key, ComponentResult result)
+{
+	if (index.count(key))
+		return;
+	result.upgradeable_facilities.shrink_to_fit();
+	result.upgradeable_transport_lines.shrink_to_fit();
+	size_t bytes = entry_bytes(result);
+	if (bytes > max_bytes)
+		return;
+
+	while (used_bytes + bytes > max_bytes)
+		evict_one();
+
+	size_t i;
+	if (free_entries.empty())
 	{
-		if (factory->transport_lines[i].item_type > current_item_type)
-			continue;
-		else
-			if (conf.transport_levels[i] != other.conf.transport_levels[i])
-				return false;
+		i = entries.size();
+		entries.push_back(Entry{key, move(result), false});
+	}
+	else
+	{
+		i = free_entries.back();
+		free_entries.pop_back();
+		entries[i] = Entry{key, move(result), false};
 	}
+	index.emplace(key, i);
+	used_bytes += bytes;
+}
 
-	return true;
+void ActionGraph::SimulationCache::set_max_bytes(size_t max_bytes_)
+{
+	max_bytes = max_bytes_;
+	while (used_bytes > max_bytes)
+		evict_one();
 }
 
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wshadow"
-vector< unique_ptr<ActionGraph::Node> > ActionGraph::Node::successors(const Factory* factory) const
-#pragma GCC diagnostic pop
+void ActionGraph::set_cache_bytes(size_t max_bytes)
+{
+	lock_guard<mutex> guard(cache_mutex);
+	simulation_cache.set_max_bytes(max_bytes);
+}
+
+size_t ActionGraph::cache_bytes()
+{
+	lock_guard<mutex> guard(cache_mutex);
+	return simulation_cache.capacity();
+}
+
+// everything a component's simulation depends on, hashed like in Node::key()
+NodeKey ActionGraph::component_key(item_t item, size_t component, const Factory::FactoryConfiguration& conf) const
+{
+	const auto& comp = factory->components_per_item[item][component];
+
+	uint64_t a = 0x452821e638d01377ull, b = 0xbe5466cf34e90c6cull;
+	auto add = [&](uint64_t value)
+	{
+		a = mix(a ^ value);
+		b = mix(b + value + 0x9e3779b97f4a7c15ull);
+	};
+	add(uint64_t(item));
+	add(factory->item_revision[item]);
+	add(component);
+	for (size_t facility_idx : comp.facilities)
+		add(conf.facility_levels[facility_idx]);
+	for (size_t transport_line_idx : comp.transport_lines)
+		add(conf.transport_levels[transport_line_idx]);
+	return NodeKey{a, b | 1};
+}
+
+// the facilities and transport lines of a simulated component that run at
+// their limit and can still be upgraded. node_saturated(i) and
+// edge_saturated(i) tell whether the component's i-th node or edge runs at
+// its limit.
+template <typename NodeSaturated, typename EdgeSaturated>
+static ActionGraph::ComponentResult component_result(const Factory* factory, const Factory::Component& comp,
+	const Factory::FactoryConfiguration& conf, bool valid, NodeSaturated node_saturated, EdgeSaturated edge_saturated)
+{
+	ActionGraph::ComponentResult result;
+	result.valid = valid;
+	if (valid)
+		return result;
+
+	// upgradeable nodes
+	for (size_t i = 0; i < comp.facilities.size(); i++)
+	{
+		const size_t facility_idx = comp.facilities[i];
+		if (node_saturated(i) && // a producing node is at max capacity
+			conf.facility_levels[facility_idx]+1 < factory->facilities[facility_idx].levels()) // and we can actually upgrade the node
+			result.upgradeable_facilities.push_back(facility_idx);
+	}
+
+	// upgradeable edges
+	for (size_t i = 0; i < comp.transport_lines.size(); i++)
+	{
+		const size_t transport_line_idx = comp.transport_lines[i];
+		if (edge_saturated(i) && // an edge is at max capacity
+			conf.transport_levels[transport_line_idx]+1 < factory->transport_lines[transport_line_idx].levels()) // and we can actually upgrade the edge
+			result.upgradeable_transport_lines.push_back(transport_line_idx);
+	}
+
+	return result;
+}
+
+ActionGraph::ComponentResult ActionGraph::simulate_component(item_t item, size_t component, const Factory::FactoryConfiguration& conf)
+{
+	const auto& comp = factory->components_per_item[item][component];
+	const NodeKey key = component_key(item, component, conf);
+
+	{
+		lock_guard<mutex> guard(cache_mutex);
+		ComponentResult cached;
+		if (simulation_cache.lookup(key, cached))
+		{
+			if (verbose) cout << "using cached flow for item type " << item << ", component " << component << endl;
+			return cached;
+		}
+	}
+
+	if (verbose) cout << "simulating flow for current item type " << item << ", component " << component << endl;
+	// construct and simulate flow graph for the component
+	FlowGraph flow = factory->build_flowgraph(item, component, conf);
+	flow.calculate();
+	if (verbose) flow.dump("FINAL");
+
+	assert(comp.facilities.size() == flow.nodes.size());
+	assert(comp.transport_lines.size() == flow.edges.size());
+	ComponentResult result = component_result(factory, comp, conf, flow.is_valid(),
+		[&](size_t i) { const auto& node = flow.nodes[i]; return node.max_production >= 0 && node.actual_production >= node.max_production; },
+		[&](size_t i) { const auto& edge = flow.edges[i]; return edge.actual_flow >= edge.capacity; });
+
+	lock_guard<mutex> guard(cache_mutex);
+	simulation_cache.insert(key, result);
+	return result;
+}
+
+void ActionGraph::simulate_components(item_t item, size_t component, const vector<Factory::FactoryConfiguration>& confs)
+{
+	const auto& comp = factory->components_per_item[item][component];
+
+	vector<Factory::FactoryConfiguration> missing;
+	vector<NodeKey> keys;
+	{
+		lock_guard<mutex> guard(cache_mutex);
+		ComponentResult cached;
+		for (const auto& conf : confs)
+		{
+			NodeKey key = component_key(item, component, conf);
+			if (simulation_cache.lookup(key, cached) || find(keys.begin(), keys.end(), key) != keys.end())
+				continue;
+			missing.push_back(conf);
+			keys.push_back(key);
+		}
+	}
+	if (missing.size() < 2)
+		return; // not worth a batch. simulate_component() will do it when needed.
+
+	// one lane per configuration, like in Factory::are_valid()
+	const size_t LANES = 16;
+	vector<ComponentResult> results;
+	for (size_t first = 0; first < missing.size(); first += LANES)
+	{
+		vector<Factory::FactoryConfiguration> chunk(missing.begin() + long(first), missing.begin() + long(min(first + LANES, missing.size())));
+		BatchFlowGraph batch = factory->build_batch_flowgraph(item, component, chunk);
+		batch.calculate();
+
+		const size_t lanes = batch.lanes;
+		for (size_t l = 0; l < lanes; l++)
+			results.push_back(component_result(factory, comp, chunk[l], batch.is_valid(l),
+				[&](size_t i) { rate_t max_prod = batch.max_production[i*lanes + l]; return max_prod >= 0 && batch.actual_production[i*lanes + l] >= max_prod; },
+				[&](size_t i) { return batch.actual_flow[i*lanes + l] >= batch.capacity[i*lanes + l]; }));
+	}
+
+	lock_guard<mutex> guard(cache_mutex);
+	for (size_t i = 0; i < results.size(); i++)
+		simulation_cache.insert(keys[i], move(results[i]));
+}
+
+vector< unique_ptr<ActionGraph::Node> > ActionGraph::Node::successors(ActionGraph& graph) const
 {
+	const Factory* factory = graph.factory;
 	vector< unique_ptr<ActionGraph::Node> > result;
 
+	const auto& components = factory->components_per_item.at(current_item_type);
+
 	#ifndef NDEBUG
 	// all flowgraphs for items that are more advanced than the current_item_type
-	// are valid (i.e., no bottlenecks). This is guaranteed by design.
+	// are valid (i.e., no bottlenecks). This is guaranteed by design. The same
+	// holds for the components of current_item_type that we've already passed.
 
 	for (int type = current_item_type+1; type < item_t::MAX_ITEM; type++)
 	{
-		cout << "checking assertion for itemtype " << type << endl;
+		if (graph.verbose) cout << "checking assertion for itemtype " << type << endl;
 		FlowGraph flow = factory->build_flowgraph(item_t(type), conf);
 		flow.calculate();
 		assert(flow.is_valid());
 	}
-	cout << "done with assertion-checking" << endl;
-	#endif
-	
-	cout << "simulating flow for current item type " << current_item_type << endl;
-	// construct and simulate flow graph for current_item_type
-	FlowGraph flow = factory->build_flowgraph(current_item_type, conf);
-	flow.calculate();
-
-	if (flow.is_valid())
+	for (size_t c = 0; c < current_component; c++)
 	{
-		auto nodeptr = make_unique<ActionGraph::Node>(*this);
-		nodeptr->current_item_type = item_t(current_item_type-1); // if this reaches '-1', then we're done.
-		nodeptr->total_cost += 0.;
-		result.emplace_back(move(nodeptr));
+		FlowGraph flow = factory->build_flowgraph(current_item_type, c, conf);
+		flow.calculate();
+		assert(flow.is_valid());
 	}
-	else
+	if (graph.verbose) cout << "done with assertion-checking" << endl;
+	#endif
+
+	// components are independent of each other, so we fix them one after
+	// another instead of interleaving their upgrades in every possible order.
+	// components which turn out valid are never simulated again by our successors.
+	for (size_t c = current_component; c < components.size(); c++)
 	{
-		// upgradeable nodes
-		const auto& toposort = factory->facility_toposort.at(current_item_type);
-		assert(toposort.size() == flow.nodes.size());
-		for (size_t i=0; i<flow.nodes.size(); i++)
-		{
-			const auto& node = flow.nodes[i];
-			const size_t facility_idx = toposort[i];
-			const auto& facility = factory->facilities[facility_idx];
+		ComponentResult simulation = graph.simulate_component(current_item_type, c, conf);
+		if (simulation.valid)
+			continue;
 
-			if ( (node.max_production >= 0 && node.actual_production >= node.max_production) && // a producing node is at max capacity
-				conf.facility_levels[facility_idx]+1 < facility.upgrade_plan.size() ) // and we can actually upgrade the node
-			{
-				auto nodeptr = make_unique<ActionGraph::Node>(*this);
-				nodeptr->conf.facility_levels[facility_idx]++;
-				nodeptr->total_cost += facility.upgrade_plan[ conf.facility_levels[facility_idx] ].incremental_cost;
-				result.emplace_back(move(nodeptr));
-			}
+		for (size_t facility_idx : simulation.upgradeable_facilities)
+		{
+			auto nodeptr = make_unique<ActionGraph::Node>(*this);
+			nodeptr->conf.facility_levels[facility_idx]++;
+			nodeptr->current_component = c;
+			nodeptr->total_cost += factory->facilities[facility_idx].incremental_cost( conf.facility_levels[facility_idx]+1 );
+			result.emplace_back(move(nodeptr));
 		}
-		
-		// upgradeable edges
-		const auto& edgetable = factory->edge_table_per_item.at(current_item_type);
-		assert(edgetable.size() == flow.edges.size());
-		for (size_t i=0; i<flow.edges.size(); i++)
-		{
-			const auto& edge = flow.edges[i];
-			const size_t transport_line_idx = edgetable[i];
-			const auto& transport_line = factory->transport_lines[transport_line_idx];
-
-			if ( (edge.actual_flow >= edge.capacity) && // an edge is at max capacity
-				conf.transport_levels[transport_line_idx]+1 < transport_line.upgrade_plan.size() ) // and we can actually upgrade the edge
-			{
-				auto nodeptr = make_unique<ActionGraph::Node>(*this);
-				nodeptr->conf.transport_levels[transport_line_idx]++;
-				nodeptr->total_cost += transport_line.upgrade_plan[ conf.transport_levels[transport_line_idx] ].incremental_cost;
-				result.emplace_back(move(nodeptr));
-			}
+
+		for (size_t transport_line_idx : simulation.upgradeable_transport_lines)
+		{
+			auto nodeptr = make_unique<ActionGraph::Node>(*this);
+			nodeptr->conf.transport_levels[transport_line_idx]++;
+			nodeptr->current_component = c;
+			nodeptr->total_cost += factory->transport_lines[transport_line_idx].incremental_cost( conf.transport_levels[transport_line_idx]+1 );
+			result.emplace_back(move(nodeptr));
 		}
+
+		return result;
 	}
 
+	// all components are valid
+	auto nodeptr = make_unique<ActionGraph::Node>(*this);
+	nodeptr->current_item_type = item_t(current_item_type-1); // if this reaches '-1', then we're done.
+	nodeptr->current_component = 0;
+	nodeptr->total_cost += 0.;
+	result.emplace_back(move(nodeptr));
+
 	return result;
 }
 
@@ -130,86 +382,510 @@ struct node_comparator
 	}
 };
 
+static void print_levels(const Factory::FactoryConfiguration& conf)
+{
+	cout << "nodes:";
+	for (auto lvl : conf.facility_levels)
+		cout << " " << lvl;
+	cout << ", edges:";
+	for (auto lvl : conf.transport_levels)
+		cout << " " << lvl;
+}
+
+static pair<Factory::FactoryConfiguration, double> as_pair(const ActionGraph::SearchResult& result, const Factory::FactoryConfiguration& initial_config)
+{
+	if (result.cost < 0.)
+		return pair<Factory::FactoryConfiguration, double>(initial_config, -1.);
+	return pair<Factory::FactoryConfiguration, double>(result.conf, result.cost);
+}
+
 pair<Factory::FactoryConfiguration, double> ActionGraph::dijkstra(Factory::FactoryConfiguration initial_config)
 {
-	auto start_node = make_unique<ActionGraph::Node>();
-	start_node->conf = initial_config;
-	start_node->current_item_type = item_t(MAX_ITEM-1);
-	start_node->total_cost = 0.;
+	return as_pair(search(initial_config, numeric_limits<double>::infinity(), initial_config, SearchLimits(), nullptr, nullptr), initial_config);
+}
+
+pair<Factory::FactoryConfiguration, double> ActionGraph::dijkstra(Factory::FactoryConfiguration initial_config,
+	const Factory::FactoryConfiguration& prior_solution)
+{
+	double bound = factory->upgrade_cost(initial_config, prior_solution);
+	if (bound < 0. || !factory->are_valid({prior_solution})[0])
+	{
+		if (verbose)
+			cout << "prior solution is no longer valid, starting from scratch" << endl;
+		return dijkstra(initial_config);
+	}
+
+	if (verbose)
+		cout << "prior solution is still valid, cost = " << bound << endl;
+	return as_pair(search(initial_config, bound, prior_solution, SearchLimits(), nullptr, nullptr), initial_config);
+}
+
+ActionGraph::SearchResult ActionGraph::anytime(const Factory::FactoryConfiguration& initial_config, SearchLimits limits,
+	const function<void(const SearchResult&)>& on_improvement)
+{
+	if (limits.dive_interval == 0)
+		limits.dive_interval = 64;
+	return search(initial_config, numeric_limits<double>::infinity(), initial_config, limits, on_improvement, nullptr);
+}
+
+ActionGraph::SearchResult ActionGraph::resume(const SearchCheckpoint& checkpoint, SearchLimits limits,
+	const function<void(const SearchResult&)>& on_improvement)
+{
+	return search(checkpoint.initial_config, numeric_limits<double>::infinity(), checkpoint.initial_config, limits, on_improvement, &checkpoint);
+}
+
+// expanding a node starts with simulating its current component, and the
+// nodes which get expanded next often need the same component in a slightly
+// different configuration. so when openlist[next] is about to be expanded and
+// its simulation isn't cached, we simulate it in lanes together with the
+// cheapest other open nodes that need the same component.
+void ActionGraph::simulate_upcoming(const vector< unique_ptr<Node> >& openlist, size_t next)
+{
+	const Node& node = *openlist[next];
+	if (node.current_item_type == DONE || node.current_component >= factory->components_per_item[node.current_item_type].size())
+		return;
+	{
+		lock_guard<mutex> guard(cache_mutex);
+		ComponentResult cached;
+		if (simulation_cache.lookup(component_key(node.current_item_type, node.current_component, node.conf), cached))
+			return;
+	}
+
+	vector<const Node*> upcoming;
+	for (size_t i = 0; i < openlist.size(); i++)
+		if (i != next && openlist[i]->current_item_type == node.current_item_type && openlist[i]->current_component == node.current_component)
+			upcoming.push_back(openlist[i].get());
+	if (upcoming.empty())
+		return;
+
+	const size_t LANES = 16; // like in simulate_components()
+	auto cheaper = [](const Node* a, const Node* b) { return a->total_cost < b->total_cost; };
+	if (upcoming.size() > LANES-1)
+	{
+		partial_sort(upcoming.begin(), upcoming.begin() + (LANES-1), upcoming.end(), cheaper);
+		upcoming.resize(LANES-1);
+	}
+
+	vector<Factory::FactoryConfiguration> confs{node.conf};
+	for (const Node* other : upcoming)
+		confs.push_back(other->conf);
+	simulate_components(node.current_item_type, node.current_component, confs);
+}
+
+// dijkstra over the action graph. nodes which cost at least `upper_bound` are
+// pruned; if no cheaper solution exists, bound_solution is returned.
+//
+// if limits.dive_interval is set, we additionally follow the cheapest
+// successor from the start node and then from every dive_interval-th
+// expanded node, until either a solution is reached (which then lowers
+// upper_bound) or it gets too expensive. when running out of budget, the
+// cheapest node in the openlist tells how much better the optimum can be.
+ActionGraph::SearchResult ActionGraph::search(const Factory::FactoryConfiguration& initial_config,
+	double upper_bound, const Factory::FactoryConfiguration& bound_solution,
+	const SearchLimits& limits, const function<void(const SearchResult&)>& on_improvement,
+	const SearchCheckpoint* resume_from)
+{
+	SearchResult result;
+	if (resume_from)
+	{
+		if (resume_from->n_facilities != factory->facilities.size() || resume_from->n_transport_lines != factory->transport_lines.size()
+			|| resume_from->factory_fingerprint != factory->fingerprint())
+			throw runtime_error("checkpoint doesn't belong to this factory");
+		result.expansions = resume_from->expansions;
+		if (resume_from->best_cost >= 0.)
+		{
+			upper_bound = resume_from->best_cost;
+			result.conf = resume_from->best_conf;
+			result.cost = resume_from->best_cost;
+		}
+	}
+	else if (upper_bound < numeric_limits<double>::infinity())
+	{
+		result.conf = bound_solution;
+		result.cost = upper_bound;
+	}
+
+	size_t previous_expansions = result.expansions; // the budget only counts this run's
+	auto start_time = chrono::steady_clock::now();
+	auto out_of_budget = [&](size_t expansions)
+	{
+		return expansions - previous_expansions >= limits.max_expansions ||
+			chrono::duration<double>(chrono::steady_clock::now() - start_time).count() >= limits.max_seconds;
+	};
+
+	auto improve = [&](const ActionGraph::Node& goal)
+	{
+		upper_bound = goal.total_cost;
+		result.conf = goal.conf;
+		result.cost = goal.total_cost;
+		if (on_improvement)
+			on_improvement(result);
+	};
+
+	auto dive = [&](const ActionGraph::Node& from)
+	{
+		ActionGraph::Node node = from;
+		while (node.current_item_type != DONE)
+		{
+			if (out_of_budget(result.expansions))
+				return;
+			result.expansions++;
 
+			auto successor_nodes = node.successors(*this);
+			auto cheapest = successor_nodes.begin();
+			for (auto it = successor_nodes.begin(); it != successor_nodes.end(); it++)
+				if ((*it)->total_cost < (*cheapest)->total_cost)
+					cheapest = it;
+
+			if (cheapest == successor_nodes.end() || (*cheapest)->total_cost >= upper_bound)
+				return; // dead end
+			node = move(**cheapest);
+		}
+
+		if (verbose)
+			cout << "dive found a solution, cost = " << node.total_cost << endl;
+		improve(node);
+	};
+
+	// only the openlist keeps whole nodes. of the expanded ones, we only
+	// remember the keys. open_index[key] = index in openlist
 	vector< unique_ptr< ActionGraph::Node> > openlist;
-	vector< unique_ptr< ActionGraph::Node> > closedlist;
-	openlist.push_back(move(start_node));
+	vector<NodeKey> openlist_keys;
+	unordered_map<NodeKey, size_t, NodeKey::hash> open_index;
+	// a checkpoint's file-backed closed list is carried on in its own file
+	bool resume_closed_file = resume_from && !resume_from->closed.file.empty();
+	ClosedSet closedlist(resume_closed_file ? "" : closed_list_file);
+
+	auto add_to_openlist = [&](unique_ptr<ActionGraph::Node> node, NodeKey key)
+	{
+		open_index[key] = openlist.size();
+		openlist_keys.push_back(key);
+		openlist.push_back(move(node));
+	};
+
+	if (resume_from)
+	{
+		if (resume_closed_file)
+			closedlist.restore(resume_from->closed);
+		for (const NodeKey& key : resume_from->closed_keys)
+			closedlist.insert(key);
+		for (const auto& open_node : resume_from->open)
+		{
+			auto node = make_unique<ActionGraph::Node>();
+			node->conf = open_node.conf;
+			node->current_item_type = open_node.current_item_type;
+			node->current_component = open_node.current_component;
+			node->total_cost = open_node.total_cost;
+			NodeKey key = node->key(factory);
+			add_to_openlist(move(node), key);
+		}
+		if (verbose)
+			cout << "resuming with " << openlist.size() << " open and " << closedlist.size() << " closed nodes" << endl;
+	}
+	else
+	{
+		auto start_node = make_unique<ActionGraph::Node>();
+		start_node->conf = initial_config;
+		start_node->current_item_type = item_t(MAX_ITEM-1);
+		start_node->current_component = 0;
+		start_node->total_cost = 0.;
+
+		if (limits.dive_interval > 0)
+			dive(*start_node);
+
+		NodeKey key = start_node->key(factory);
+		add_to_openlist(move(start_node), key);
+	}
+
+	// the state between two expansions is written to checkpoint_file every
+	// now and then. only the openlist is copied here; the closed list is just
+	// snapshotted, and the writing happens in the background.
+	unique_ptr<CheckpointWriter> checkpoint_writer;
+	uint64_t fingerprint = 0;
+	if (!checkpoint_file.empty())
+	{
+		checkpoint_writer = make_unique<CheckpointWriter>(checkpoint_file);
+		fingerprint = factory->fingerprint();
+	}
+	auto last_checkpoint = chrono::steady_clock::now();
+	auto take_checkpoint = [&]()
+	{
+		SearchCheckpoint checkpoint;
+		checkpoint.n_facilities = factory->facilities.size();
+		checkpoint.n_transport_lines = factory->transport_lines.size();
+		checkpoint.factory_fingerprint = fingerprint;
+		checkpoint.initial_config = initial_config;
+		checkpoint.best_conf = result.conf;
+		checkpoint.best_cost = result.cost;
+		checkpoint.expansions = result.expansions;
+		checkpoint.closed = closedlist.snapshot();
+		checkpoint.open.reserve(openlist.size());
+		for (const auto& node : openlist)
+			checkpoint.open.push_back(SearchCheckpoint::OpenNode{node->conf, node->current_item_type, node->current_component, node->total_cost});
+		checkpoint_writer->submit(move(checkpoint));
+		last_checkpoint = chrono::steady_clock::now();
+	};
 
 	while (!openlist.empty())
 	{
-		cout << "openlist has size " << openlist.size() << ", total expanded = " << openlist.size() + closedlist.size() << endl;
+		if (checkpoint_writer && chrono::duration<double>(chrono::steady_clock::now() - last_checkpoint).count() >= checkpoint_interval)
+			take_checkpoint();
+
+		if (verbose)
+			cout << "openlist has size " << openlist.size() << ", total expanded = " << openlist.size() + closedlist.size() << endl;
 
 		// find and remove smallest element
-		auto smallest = openlist.begin();
-		for (auto it = openlist.begin(); it != openlist.end(); it++)
-			if ((*it)->total_cost < (*smallest)->total_cost)
-				smallest=it;
-		
-		closedlist.push_back(move(*smallest));
-		auto& nodeptr = closedlist.back();
-		*smallest = move(openlist.back());
+		size_t smallest = 0;
+		for (size_t i = 0; i < openlist.size(); i++)
+			if (openlist[i]->total_cost < openlist[smallest]->total_cost)
+				smallest=i;
+
+		if (openlist[smallest]->total_cost >= upper_bound)
+			break; // everything that's left is at least as expensive as what we have
+
+		if (out_of_budget(result.expansions))
+		{
+			result.lower_bound = openlist[smallest]->total_cost;
+			if (checkpoint_writer)
+				take_checkpoint();
+			if (verbose)
+				cout << "out of budget, cost = " << result.cost << ", lower bound = " << result.lower_bound << ", expanded " << closedlist.size() + openlist.size() << " nodes" << endl;
+			return result;
+		}
+		result.expansions++;
+
+		if (batch_successors && !verbose)
+			simulate_upcoming(openlist, smallest);
+
+		unique_ptr<ActionGraph::Node> nodeptr = move(openlist[smallest]);
+		closedlist.insert(openlist_keys[smallest]);
+		open_index.erase(openlist_keys[smallest]);
+		if (smallest != openlist.size()-1)
+		{
+			openlist[smallest] = move(openlist.back());
+			openlist_keys[smallest] = openlist_keys.back();
+			open_index[openlist_keys[smallest]] = smallest;
+		}
 		openlist.pop_back();
+		openlist_keys.pop_back();
 
-		cout << "inspecting item: " << nodeptr->current_item_type << ", ";
-		cout << "nodes:";
-		for (auto lvl : nodeptr->conf.facility_levels)
-			cout << " " << lvl;
-		cout << ", edges:";
-		for (auto lvl : nodeptr->conf.transport_levels)
-			cout << " " << lvl;
-		cout << endl;
+		if (verbose)
+		{
+			cout << "inspecting item: " << nodeptr->current_item_type << ", ";
+			print_levels(nodeptr->conf);
+			cout << endl;
+		}
 
 
 		// expand node
-		auto successor_nodes = nodeptr->successors(factory);
+		auto successor_nodes = nodeptr->successors(*this);
 		for (auto& successor : successor_nodes)
 		{
-			cout << "  -> successor item: " << successor->current_item_type << ", ";
-			cout << "nodes:";
-			for (auto lvl : successor->conf.facility_levels)
-				cout << " " << lvl;
-			cout << ", edges:";
-			for (auto lvl : successor->conf.transport_levels)
-				cout << " " << lvl;
+			if (verbose)
+			{
+				cout << "  -> successor item: " << successor->current_item_type << ", ";
+				print_levels(successor->conf);
+			}
+			if (successor->total_cost >= upper_bound)
+			{
+				if (verbose) cout << "; too expensive" << endl;
+				continue;
+			}
 			if (successor->current_item_type == DONE)
 			{
 				// we've found a goal state! :)
-				cout << endl << "success, cost = " << successor->total_cost << ", expanded " << closedlist.size() + openlist.size() << " nodes" << endl;
-				return pair<Factory::FactoryConfiguration, double>(successor->conf, successor->total_cost);
+				// it's as cheap as the node we've just expanded, so nothing can be cheaper.
+				if (verbose)
+					cout << endl << "success, cost = " << successor->total_cost << ", expanded " << closedlist.size() + openlist.size() << " nodes" << endl;
+				improve(*successor);
+				result.lower_bound = successor->total_cost;
+				return result;
 			}
 
-			bool found = false;
-			for (auto& openlist_node : openlist)
-				if (openlist_node->equals(*successor, factory))
-				{
+			NodeKey key = successor->key(factory);
+			auto iter = open_index.find(key);
+			if (iter != open_index.end())
+			{
+				auto& openlist_node = openlist[iter->second];
+				if (successor->total_cost < openlist_node->total_cost)
 					openlist_node = move(successor);
-					cout << "; already in openlist" << endl;
-					found = true;
-					break;
-				}
-			if (!found)
-				for (auto& closedlist_node : closedlist)
-					if (closedlist_node->equals(*successor, factory))
-					{
-						found = true;
-						cout << "; already in closedlist" << endl;
-						break;
-					}
-
-			if (!found)
+				if (verbose) cout << "; already in openlist" << endl;
+			}
+			else if (closedlist.contains(key))
+			{
+				if (verbose) cout << "; already in closedlist" << endl;
+			}
+			else
 			{
-				openlist.push_back(move(successor));
-				cout << "; not seen yet, adding to openlist" << endl;
+				add_to_openlist(move(successor), key);
+				if (verbose) cout << "; not seen yet, adding to openlist" << endl;
 			}
 		}
+
+		if (limits.dive_interval > 0 && result.expansions % limits.dive_interval == 0)
+			dive(*nodeptr);
 	}
 
-	cout << "could not find a solution :(" << endl;
-	return pair<Factory::FactoryConfiguration, double>(initial_config, -1.);
+	result.lower_bound = upper_bound;
+	if (upper_bound < numeric_limits<double>::infinity())
+	{
+		if (verbose)
+			cout << "nothing cheaper than cost = " << upper_bound << ", expanded " << closedlist.size() + openlist.size() << " nodes" << endl;
+		return result;
+	}
+
+	if (verbose)
+		cout << "could not find a solution :(" << endl;
+	return result;
+}
+
+// the part of conf that belongs to the island
+static Factory::FactoryConfiguration island_configuration(const FactoryIsland& island, const Factory::FactoryConfiguration& conf)
+{
+	Factory::FactoryConfiguration result;
+	for (size_t id : island.facility_ids)
+		result.facility_levels.push_back(conf.facility_levels[id]);
+	for (size_t id : island.transport_line_ids)
+		result.transport_levels.push_back(conf.transport_levels[id]);
+	return result;
+}
+
+// writes an island's configuration back into the whole factory's conf
+static void merge_island_configuration(const FactoryIsland& island, const Factory::FactoryConfiguration& island_conf, Factory::FactoryConfiguration& conf)
+{
+	for (size_t j = 0; j < island.facility_ids.size(); j++)
+		conf.facility_levels[island.facility_ids[j]] = island_conf.facility_levels[j];
+	for (size_t j = 0; j < island.transport_line_ids.size(); j++)
+		conf.transport_levels[island.transport_line_ids[j]] = island_conf.transport_levels[j];
+}
+
+size_t ActionGraph::all_threads() const
+{
+	return n_threads ? n_threads : max(1u, thread::hardware_concurrency());
+}
+
+pair<Factory::FactoryConfiguration, double> ActionGraph::dijkstra_islands(const Factory::FactoryConfiguration& initial_config)
+{
+	vector<FactoryIsland> islands = split_into_islands(*factory);
+	if (islands.size() <= 1)
+		return dijkstra(initial_config);
+
+	if (verbose)
+		cout << "factory consists of " << islands.size() << " independent islands" << endl;
+
+	vector< pair<Factory::FactoryConfiguration, double> > results(islands.size());
+	size_t n_island_threads = min(all_threads(), islands.size());
+	size_t n_init_threads = max<size_t>(1, all_threads() / n_island_threads);
+	size_t island_cache_bytes = cache_bytes() / n_island_threads;
+	parallel_for(islands.size(), n_island_threads, [&](size_t i, size_t)
+	{
+		auto& island = islands[i];
+		island.factory.initialize(n_init_threads);
+
+		ActionGraph sub_graph(&island.factory);
+		sub_graph.verbose = false;
+		sub_graph.set_cache_bytes(island_cache_bytes);
+		if (!closed_list_file.empty())
+			sub_graph.closed_list_file = closed_list_file + "." + to_string(i);
+		results[i] = sub_graph.dijkstra(island_configuration(island, initial_config));
+	});
+
+	// combine the islands' results
+	Factory::FactoryConfiguration result = initial_config;
+	double total_cost = 0.;
+	for (size_t i = 0; i < islands.size(); i++)
+	{
+		if (results[i].second < 0.)
+		{
+			if (verbose)
+				cout << "could not find a solution for island " << i << " :(" << endl;
+			return pair<Factory::FactoryConfiguration, double>(initial_config, -1.);
+		}
+
+		merge_island_configuration(islands[i], results[i].first, result);
+		total_cost += results[i].second;
+	}
+
+	if (verbose)
+		cout << "success, cost = " << total_cost << ", combined from " << islands.size() << " islands" << endl;
+	return pair<Factory::FactoryConfiguration, double>(result, total_cost);
+}
+
+ActionGraph::SearchResult ActionGraph::anytime_islands(const Factory::FactoryConfiguration& initial_config, SearchLimits limits,
+	const function<void(const SearchResult&)>& on_improvement)
+{
+	// a checkpoint holds a single search, so checkpointed searches don't split
+	vector<FactoryIsland> islands;
+	if (checkpoint_file.empty())
+		islands = split_into_islands(*factory);
+	if (islands.size() <= 1)
+		return anytime(initial_config, limits, on_improvement);
+
+	if (verbose)
+		cout << "factory consists of " << islands.size() << " independent islands" << endl;
+
+	// the islands share the budget: the time limit holds for all of them
+	// together, and every island gets an equal share of the expansions.
+	auto start = chrono::steady_clock::now();
+	double max_seconds = limits.max_seconds;
+	limits.max_expansions = max<size_t>(1, limits.max_expansions / islands.size());
+
+	vector<SearchResult> results(islands.size());
+	mutex results_mutex;
+	auto combined = [&]()
+	{
+		SearchResult result;
+		result.conf = initial_config;
+		result.cost = 0.;
+		for (size_t i = 0; i < islands.size(); i++)
+		{
+			result.lower_bound += results[i].lower_bound;
+			result.expansions += results[i].expansions;
+			if (results[i].cost < 0. || result.cost < 0.)
+				result.cost = -1.;
+			else
+			{
+				result.cost += results[i].cost;
+				merge_island_configuration(islands[i], results[i].conf, result.conf);
+			}
+		}
+		if (result.cost < 0.)
+			result.conf = initial_config;
+		return result;
+	};
+
+	size_t n_island_threads = min(all_threads(), islands.size());
+	size_t n_init_threads = max<size_t>(1, all_threads() / n_island_threads);
+	size_t island_cache_bytes = cache_bytes() / n_island_threads;
+	parallel_for(islands.size(), n_island_threads, [&](size_t i, size_t)
+	{
+		auto& island = islands[i];
+		island.factory.initialize(n_init_threads);
+
+		ActionGraph sub_graph(&island.factory);
+		sub_graph.verbose = false;
+		sub_graph.set_cache_bytes(island_cache_bytes);
+		if (!closed_list_file.empty())
+			sub_graph.closed_list_file = closed_list_file + "." + to_string(i);
+
+		// islands that only start after others are done get what's left of the time
+		SearchLimits island_limits = limits;
+		island_limits.max_seconds = max(0., max_seconds - chrono::duration<double>(chrono::steady_clock::now() - start).count());
+
+		// an improvement of the whole factory needs a solution for every island
+		auto improved = [&](const SearchResult& island_result)
+		{
+			lock_guard<mutex> guard(results_mutex);
+			results[i] = island_result;
+			SearchResult result = combined();
+			if (result.cost >= 0. && on_improvement)
+				on_improvement(result);
+		};
+		SearchResult island_result = sub_graph.anytime(island_configuration(island, initial_config), island_limits, improved);
+
+		lock_guard<mutex> guard(results_mutex);
+		results[i] = island_result;
+	});
+
+	return combined();
 }
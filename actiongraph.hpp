@@ -3,7 +3,14 @@
 #include <vector>
 #include <memory>
 #include <utility>
+#include <string>
+#include <mutex>
+#include <unordered_map>
+#include <functional>
+#include <limits>
 #include "factory.hpp"
+#include "closedset.hpp"
+#include "checkpoint.hpp"
 
 struct ActionGraph
 {
@@ -13,16 +20,166 @@ struct ActionGraph
 	{
 		Factory::FactoryConfiguration conf;
 		item_t current_item_type;
+		size_t current_component; // all components of current_item_type before this one are valid
 		double total_cost;
 
 		bool equals(const ActionGraph::Node& other, const Factory* factory) const;
-		std::vector< std::unique_ptr<Node> > successors(const Factory* factory) const;
+		NodeKey key(const Factory* factory) const; // equal for nodes that equals() each other
+		std::vector< std::unique_ptr<Node> > successors(ActionGraph& graph) const;
+	};
+
+	// what simulating one component of an item's flowgraph tells the search
+	struct ComponentResult
+	{
+		bool valid;
+		std::vector<size_t> upgradeable_facilities; // indices in factory->facilities
+		std::vector<size_t> upgradeable_transport_lines; // indices in factory->transport_lines
+	};
+
+	// component simulation results by a 128 bit hash of what they depend on
+	// (like the closed set, we accept the negligible chance of a collision).
+	// holds up to max_bytes, and when full, evicts one entry at a time with
+	// the clock algorithm: entries that were used since the hand last passed
+	// get another round, the others are evicted. not thread safe.
+	struct SimulationCache
+	{
+		explicit SimulationCache(size_t max_bytes_) : max_bytes(max_bytes_) {}
+
+		bool lookup(NodeKey key, ComponentResult& result);
+		void insert(NodeKey key, ComponentResult result);
+		void set_max_bytes(size_t max_bytes_); // evicts entries until they fit
+		size_t size() const { return index.size(); }
+		size_t bytes() const { return used_bytes; }
+		size_t capacity() const { return max_bytes; }
+
+		private:
+			size_t max_bytes;
+			struct Entry
+			{
+				NodeKey key;
+				ComponentResult result;
+				bool referenced;
+			};
+
+			std::vector<Entry> entries; // the clock. evicted entries are reused
+			std::vector<size_t> free_entries;
+			std::unordered_map<NodeKey, size_t, NodeKey::hash> index; // into entries
+			size_t hand = 0;
+			size_t used_bytes = 0;
+
+			static size_t entry_bytes(const ComponentResult& result);
+			void evict_one();
+	};
+
+	// what a search found, and how good it is
+	struct SearchResult
+	{
+		Factory::FactoryConfiguration conf; // the best solution found
+		double cost = -1.; // its cost, negative if no solution was found
+		double lower_bound = 0.; // no solution is cheaper than this
+		size_t expansions = 0;
+
+		bool optimal() const { return cost >= 0. && cost <= lower_bound; }
+		// the solution costs at most this many times the optimum
+		double suboptimality() const
+		{
+			if (optimal())
+				return 1.; // also if both are zero
+			return lower_bound > 0. ? cost / lower_bound : std::numeric_limits<double>::infinity();
+		}
+	};
+
+	struct SearchLimits
+	{
+		size_t max_expansions = std::numeric_limits<size_t>::max();
+		double max_seconds = std::numeric_limits<double>::infinity();
+		size_t dive_interval = 0; // every that many expansions, greedily try to find a better solution. 0 disables this.
 	};
 
 	const Factory* factory;
+	bool verbose = true; // dump the search progress to stdout
+
+	// the search only remembers the keys of expanded nodes. if this is set,
+	// they're kept in a memory mapped file (see ClosedSet) instead of in RAM.
+	std::string closed_list_file;
+
+	// if set, the searches write their state to this file every
+	// checkpoint_interval seconds, from which resume() can continue them.
+	std::string checkpoint_file;
+	double checkpoint_interval = 60.;
+
+	// how many threads dijkstra_islands() and anytime_islands() use, 0 = one
+	// per core. islands are searched in parallel on them, and share this
+	// graph's cache budget: each island's search gets an equal part of
+	// cache_bytes().
+	size_t n_threads = 0;
+
+	// simulation results are cached across nodes and across searches, keyed
+	// by the item's revision and the component's upgrade levels. so after an
+	// edit of the factory, only the items that actually changed are
+	// simulated again; stale entries age out of the SimulationCache like any
+	// other. thread safe.
+	ComponentResult simulate_component(item_t item, size_t component, const Factory::FactoryConfiguration& conf);
+	void set_cache_bytes(size_t max_bytes); // 256 MiB by default
+	size_t cache_bytes(); // the limit, not what's in use
+	// simulates the component for all confs at once, in the lanes of
+	// BatchFlowGraphs, and caches the results for simulate_component().
+	void simulate_components(item_t item, size_t component, const std::vector<Factory::FactoryConfiguration>& confs);
+	// whether the search simulates the nodes it is about to expand in lanes,
+	// with simulate_components(). never in verbose mode, which dumps every
+	// single flowgraph.
+	bool batch_successors = true;
 
 	// finds the cheapest upgraded configuration that satisfies all demands.
 	// pair.first will contain the configuration, and pair.second the cost.
 	// if pair.second is negative, this signifies that no solution could be found.
 	std::pair<Factory::FactoryConfiguration, double> dijkstra(Factory::FactoryConfiguration initial_config);
+
+	// same as dijkstra(), but warm-started from a previous solution, e.g.
+	// from before a small edit. if prior_solution is an upgrade of
+	// initial_config that still satisfies all demands, its cost bounds the
+	// search: nothing at least as expensive is explored, and prior_solution
+	// is returned if nothing cheaper exists.
+	std::pair<Factory::FactoryConfiguration, double> dijkstra(Factory::FactoryConfiguration initial_config,
+		const Factory::FactoryConfiguration& prior_solution);
+
+	// anytime version of dijkstra(): greedily dives for some solution first,
+	// then keeps searching for better ones until it has proven optimality or
+	// runs out of its budget. the lower bound is the cheapest node that is
+	// still waiting for expansion, so the returned solution is within a factor
+	// of result.suboptimality() of the optimum. on_improvement is called
+	// whenever a better solution has been found.
+	SearchResult anytime(const Factory::FactoryConfiguration& initial_config, SearchLimits limits,
+		const std::function<void(const SearchResult&)>& on_improvement = nullptr);
+
+	// continues a search from a checkpoint, which must have been written by
+	// a search on the same factory. dijkstra() continues as dijkstra(), and
+	// anytime() as anytime() if limits.dive_interval is set.
+	SearchResult resume(const SearchCheckpoint& checkpoint, SearchLimits limits,
+		const std::function<void(const SearchResult&)>& on_improvement = nullptr);
+
+	// same as dijkstra(), but splits the factory into independent islands
+	// first, which are then optimized in parallel and combined.
+	std::pair<Factory::FactoryConfiguration, double> dijkstra_islands(const Factory::FactoryConfiguration& initial_config);
+
+	// same as anytime(), but for every island separately, like
+	// dijkstra_islands(). the islands share the time limit, and each gets an
+	// equal share of the expansions. on_improvement is called once every
+	// island has a solution. doesn't split the factory if checkpoint_file is
+	// set, as a checkpoint holds a single search.
+	SearchResult anytime_islands(const Factory::FactoryConfiguration& initial_config, SearchLimits limits,
+		const std::function<void(const SearchResult&)>& on_improvement = nullptr);
+
+	private:
+		SearchResult search(const Factory::FactoryConfiguration& initial_config,
+			double upper_bound, const Factory::FactoryConfiguration& bound_solution,
+			const SearchLimits& limits, const std::function<void(const SearchResult&)>& on_improvement,
+			const SearchCheckpoint* resume_from);
+
+		void simulate_upcoming(const std::vector< std::unique_ptr<Node> >& openlist, size_t next);
+		NodeKey component_key(item_t item, size_t component, const Factory::FactoryConfiguration& conf) const;
+		size_t all_threads() const; // n_threads, or the number of cores
+
+		std::mutex cache_mutex;
+		SimulationCache simulation_cache{256 << 20};
 };
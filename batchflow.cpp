@@ -0,0 +1,259 @@
+#include <vector>
+#include <algorithm>
+#include <cassert>
+
+#include "batchflow.hpp"
+
+using namespace std;
+
+// the lane loops below are written such that the compiler can vectorize them.
+// with GCC on x86-64, we additionally let it build AVX-512 and AVX2 variants
+// of the kernels, one of which is picked at load time depending on the cpu.
+// everything else uses the default (scalar / SSE2) version, which can't
+// vectorize the comparisons of 64 bit rates (see rate.hpp).
+#if defined(__GNUC__) && !defined(__clang__) && defined(__x86_64__)
+	#define SIMD_KERNEL __attribute__((target_clones("avx512f","avx2","default")))
+#else
+	#define SIMD_KERNEL
+#endif
+
+BatchFlowGraph::BatchFlowGraph(size_t n_nodes_, size_t n_edges_, size_t lanes_) :
+	lanes(lanes_), n_nodes(n_nodes_), n_edges(n_edges_),
+	max_production(n_nodes_*lanes_), actual_production(n_nodes_*lanes_), excess(n_nodes_*lanes_),
+	capacity(n_edges_*lanes_), actual_capacity(n_edges_*lanes_), actual_flow(n_edges_*lanes_),
+	amount_remaining(lanes_), edges_remaining(lanes_), fair_share(lanes_), incoming_sum(lanes_)
+{
+}
+
+void BatchFlowGraph::build(const vector<size_t>& from, const vector<size_t>& to)
+{
+	assert(from.size() == n_edges && to.size() == n_edges);
+
+	in_begin.assign(n_nodes+1, 0);
+	out_begin.assign(n_nodes+1, 0);
+	for (size_t e = 0; e < n_edges; e++)
+	{
+		in_begin[to[e]+1]++;
+		out_begin[from[e]+1]++;
+	}
+	for (size_t n = 0; n < n_nodes; n++)
+	{
+		in_begin[n+1] += in_begin[n];
+		out_begin[n+1] += out_begin[n];
+	}
+
+	in_edges.resize(n_edges);
+	out_edges.resize(n_edges);
+	vector<size_t> in_fill(in_begin.begin(), in_begin.end()-1);
+	vector<size_t> out_fill(out_begin.begin(), out_begin.end()-1);
+	for (size_t e = 0; e < n_edges; e++)
+	{
+		in_edges[in_fill[to[e]]++] = e;
+		out_edges[out_fill[from[e]]++] = e;
+	}
+
+	size_t max_degree = 0;
+	exact_division.resize(n_nodes);
+	for (size_t n = 0; n < n_nodes; n++)
+	{
+		size_t in_degree = in_begin[n+1]-in_begin[n];
+		assert(in_degree <= MAX_FAN_IN);
+		exact_division[n] = in_degree > MAX_DOUBLE_FAN_IN;
+		max_degree = max(max_degree, max(in_degree, out_begin[n+1]-out_begin[n]));
+	}
+	saturated.resize(max_degree * lanes);
+}
+
+SIMD_KERNEL
+static void sum_flows(size_t lanes, const size_t* edges, size_t degree, const rate_t* flow, rate_t* result)
+{
+	for (size_t l = 0; l < lanes; l++)
+		result[l] = 0;
+
+	for (size_t k = 0; k < degree; k++)
+	{
+		const rate_t* f = flow + edges[k]*lanes;
+		for (size_t l = 0; l < lanes; l++)
+			result[l] += f[l];
+	}
+}
+
+// distributes remaining[l] fairly over the edges, where each edge can take at
+// most its capacity in `cap`. edges whose capacity is below the fair share get
+// their capacity, all others get the fair share. this is what the sorted loops
+// in FlowGraph::Node::update_forward/backward do, but it doesn't need a per-lane
+// sort: saturating an edge can only increase the fair share of the remaining
+// ones, so we can saturate all edges below the current fair share at once and
+// repeat until nothing changes. `result` is only written for active lanes
+// (active == nullptr means all lanes). the fair share is divided as doubles,
+// which vectorizes, unless `exact` (see MAX_DOUBLE_FAN_IN).
+SIMD_KERNEL
+static void fair_distribution(size_t lanes, const size_t* edges, size_t degree,
+	const rate_t* cap, rate_t* result, const rate_t* active, bool exact,
+	unsigned char* saturated, rate_t* remaining, rate_t* unsat, rate_t* fair)
+{
+	auto fair_shares = [&]()
+	{
+		if (exact)
+			for (size_t l = 0; l < lanes; l++)
+				fair[l] = unsat[l] > 0 ? remaining[l] / unsat[l] : 0;
+		else
+			for (size_t l = 0; l < lanes; l++)
+				fair[l] = unsat[l] > 0 ? rate_t(double(remaining[l]) / double(unsat[l])) : 0;
+	};
+
+	for (size_t l = 0; l < lanes; l++)
+		unsat[l] = rate_t(degree);
+	for (size_t i = 0; i < degree*lanes; i++)
+		saturated[i] = 0;
+
+	for (size_t pass = 0; pass < degree; pass++)
+	{
+		fair_shares();
+
+		rate_t changed = 0;
+		for (size_t k = 0; k < degree; k++)
+		{
+			const rate_t* c = cap + edges[k]*lanes;
+			unsigned char* sat = saturated + k*lanes;
+			for (size_t l = 0; l < lanes; l++)
+			{
+				rate_t s = (!sat[l] && c[l] <= fair[l]);
+				remaining[l] -= s ? c[l] : 0;
+				unsat[l] -= s;
+				sat[l] |= (unsigned char)s;
+				changed |= s;
+			}
+		}
+
+		if (!changed)
+			break;
+	}
+
+	fair_shares();
+
+	for (size_t k = 0; k < degree; k++)
+	{
+		const rate_t* c = cap + edges[k]*lanes;
+		rate_t* r = result + edges[k]*lanes;
+		const unsigned char* sat = saturated + k*lanes;
+		for (size_t l = 0; l < lanes; l++)
+		{
+			rate_t value = sat[l] ? c[l] : fair[l];
+			r[l] = (active == nullptr || active[l]) ? value : r[l];
+		}
+	}
+}
+
+SIMD_KERNEL
+static void forward_production(size_t lanes, const rate_t* max_prod, const rate_t* incoming, rate_t* actual_prod, rate_t* available)
+{
+	for (size_t l = 0; l < lanes; l++)
+	{
+		rate_t prod = max_prod[l] > 0 ? max_prod[l] : -min(incoming[l], -max_prod[l]); // never consume more than incoming
+		actual_prod[l] = prod;
+		available[l] = max(rate_t(0), incoming[l] + prod);
+	}
+}
+
+SIMD_KERNEL
+static void forward_excess(size_t lanes, const rate_t* remaining, const rate_t* unsat, rate_t* actual_prod, rate_t* excess)
+{
+	for (size_t l = 0; l < lanes; l++)
+	{
+		rate_t ex = unsat[l] == 0 ? remaining[l] : 0;
+		rate_t reduction = actual_prod[l] > 0 ? min(ex, actual_prod[l]) : 0;
+		actual_prod[l] -= reduction;
+		excess[l] = ex - reduction;
+	}
+}
+
+// `incoming` becomes the mask of the lanes with excess
+SIMD_KERNEL
+static void backward_remaining(size_t lanes, const rate_t* excess, rate_t* incoming, rate_t* remaining)
+{
+	for (size_t l = 0; l < lanes; l++)
+	{
+		remaining[l] = incoming[l] - excess[l];
+		incoming[l] = excess[l] > 0;
+	}
+}
+
+// see FlowGraph::Node::update_forward
+void BatchFlowGraph::update_forward(size_t node)
+{
+	const size_t* in = in_edges.data() + in_begin[node];
+	const size_t* out = out_edges.data() + out_begin[node];
+	size_t in_degree = in_begin[node+1] - in_begin[node];
+	size_t out_degree = out_begin[node+1] - out_begin[node];
+
+	sum_flows(lanes, in, in_degree, actual_flow.data(), incoming_sum.data());
+	forward_production(lanes, max_production.data() + node*lanes, incoming_sum.data(),
+		actual_production.data() + node*lanes, amount_remaining.data());
+	fair_distribution(lanes, out, out_degree, actual_capacity.data(), actual_flow.data(), nullptr, exact_division[node],
+		saturated.data(), amount_remaining.data(), edges_remaining.data(), fair_share.data());
+	forward_excess(lanes, amount_remaining.data(), edges_remaining.data(),
+		actual_production.data() + node*lanes, excess.data() + node*lanes);
+}
+
+// see FlowGraph::Node::update_backward
+void BatchFlowGraph::update_backward(size_t node)
+{
+	const rate_t* ex = excess.data() + node*lanes;
+	bool any = false;
+	for (size_t l = 0; l < lanes; l++)
+		any |= (ex[l] > 0);
+	if (!any)
+		return;
+
+	const size_t* in = in_edges.data() + in_begin[node];
+	size_t in_degree = in_begin[node+1] - in_begin[node];
+	assert(in_degree > 0);
+
+	sum_flows(lanes, in, in_degree, actual_flow.data(), incoming_sum.data());
+	backward_remaining(lanes, ex, incoming_sum.data(), amount_remaining.data()); // incoming_sum is reused as the "active" mask
+
+	fair_distribution(lanes, in, in_degree, actual_flow.data(), actual_capacity.data(), incoming_sum.data(), exact_division[node],
+		saturated.data(), amount_remaining.data(), edges_remaining.data(), fair_share.data());
+}
+
+void BatchFlowGraph::calculate()
+{
+	actual_capacity = capacity;
+	fill(actual_flow.begin(), actual_flow.end(), 0);
+	fill(actual_production.begin(), actual_production.end(), 0);
+	fill(excess.begin(), excess.end(), 0);
+
+	bool done;
+	do
+	{
+		for (size_t n = 0; n < n_nodes; n++)
+			update_forward(n);
+
+		for (size_t n = 0; n < n_nodes; n++)
+			update_backward(n);
+
+		// lanes that have converged stay unchanged in further iterations
+		done = true;
+		for (rate_t ex : excess)
+			if (ex > 0)
+				done = false;
+	} while (!done);
+}
+
+rate_t BatchFlowGraph::incoming(size_t node, size_t lane) const
+{
+	rate_t result = 0;
+	for (size_t i = in_begin[node]; i < in_begin[node+1]; i++)
+		result += actual_flow[in_edges[i]*lanes + lane];
+	return result;
+}
+
+// a lane is valid if all nodes have sufficient input
+bool BatchFlowGraph::is_valid(size_t lane) const
+{
+	for (size_t n = 0; n < n_nodes; n++)
+		if (incoming(n, lane) < -max_production[n*lanes + lane])
+			return false;
+	return true;
+}
@@ -0,0 +1,52 @@
+#pragma once
+#include <vector>
+#include <cstddef>
+
+#include "rate.hpp"
+
+// simulates many configurations ("lanes") of the same flowgraph at once.
+// all lanes share the topology, only production rates and capacities differ.
+// per-lane data is stored as structure-of-arrays: the value of lane l for
+// node/edge i lives at [i*lanes + l], so that the sweeps over the lanes of one
+// node vectorize. gives the same results as FlowGraph::calculate() per lane
+// (for nodes without buffers, which this doesn't support).
+struct BatchFlowGraph
+{
+	BatchFlowGraph(size_t n_nodes, size_t n_edges, size_t lanes_);
+
+	size_t lanes;
+	size_t n_nodes;
+	size_t n_edges;
+
+	// topology, in CSR format: the incoming edges of node n are
+	// in_edges[in_begin[n] .. in_begin[n+1]), likewise for outgoing edges.
+	// nodes must be topologically sorted, like in FlowGraph.
+	std::vector<size_t> in_begin, in_edges;
+	std::vector<size_t> out_begin, out_edges;
+
+	// per-lane node data
+	std::vector<rate_t> max_production; // negative production = consumption, zero = splitter
+	std::vector<rate_t> actual_production;
+	std::vector<rate_t> excess;
+
+	// per-lane edge data
+	std::vector<rate_t> capacity;
+	std::vector<rate_t> actual_capacity;
+	std::vector<rate_t> actual_flow;
+
+	// sets up in_* and out_* from an edge list. edge e goes from from[e] to to[e].
+	void build(const std::vector<size_t>& from, const std::vector<size_t>& to);
+	void calculate();
+
+	rate_t incoming(size_t node, size_t lane) const;
+	bool is_valid(size_t lane) const;
+
+	private:
+		void update_forward(size_t node);
+		void update_backward(size_t node);
+
+		// per-lane scratch space
+		std::vector<rate_t> amount_remaining, edges_remaining, fair_share, incoming_sum;
+		std::vector<unsigned char> saturated; // one entry per edge and lane
+		std::vector<unsigned char> exact_division; // per node: more than MAX_DOUBLE_FAN_IN incoming edges
+};
@@ -0,0 +1,162 @@
+#include <string>
+#include <vector>
+#include <sstream>
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <stdexcept>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <limits>
+
+#include <glob.h>
+
+#include "batchsolve.hpp"
+#include "factory.hpp"
+#include "read_factory.h"
+
+using namespace std;
+
+size_t available_memory()
+{
+	ifstream meminfo("/proc/meminfo");
+	string key;
+	size_t kilobytes;
+	while (meminfo >> key >> kilobytes)
+	{
+		if (key == "MemAvailable:")
+			return kilobytes * 1024;
+		meminfo.ignore(numeric_limits<streamsize>::max(), '\n');
+	}
+	return 0;
+}
+
+// patterns that don't match anything are kept as they are, so that they
+// show up as an error instead of silently vanishing.
+static vector<string> expand_patterns(const vector<string>& patterns)
+{
+	vector<string> files;
+	for (const string& pattern : patterns)
+	{
+		glob_t matches;
+		if (glob(pattern.c_str(), GLOB_NOCHECK, nullptr, &matches) == 0)
+			for (size_t i = 0; i < matches.gl_pathc; i++)
+				files.push_back(matches.gl_pathv[i]);
+		else
+			files.push_back(pattern);
+		globfree(&matches);
+	}
+	return files;
+}
+
+// "index+levels" for every upgraded entry, one based
+static string upgrades(const vector<size_t>& from, const vector<size_t>& to)
+{
+	string result;
+	for (size_t i = 0; i < from.size(); i++)
+		if (to[i] != from[i])
+			result += (result.empty() ? "" : ",") + to_string(i+1) + "+" + to_string(to[i] - from[i]);
+	return result.empty() ? "-" : result;
+}
+
+static string solve(const string& file, const BatchOptions& options, bool& failed)
+{
+	auto start = chrono::steady_clock::now();
+	try
+	{
+		// the workers already keep the cores busy
+		Factory factory = read_factory(file, false);
+		factory.initialize(1);
+
+		Factory::FactoryConfiguration initial;
+		initial.facility_levels.assign(factory.facilities.size(), 0);
+		initial.transport_levels.assign(factory.transport_lines.size(), 0);
+
+		ActionGraph graph(&factory);
+		graph.verbose = false;
+		graph.n_threads = 1;
+		graph.set_cache_bytes(options.cache_bytes);
+		auto found = graph.anytime_islands(initial, options.limits);
+		double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+		ostringstream line;
+		line << file << '\t';
+		if (found.cost < 0.)
+			line << "none\t" << found.lower_bound << "\t-\t-";
+		else
+			line << found.cost << '\t' << found.lower_bound << '\t'
+			     << upgrades(initial.facility_levels, found.conf.facility_levels) << '\t'
+			     << upgrades(initial.transport_levels, found.conf.transport_levels);
+		line << '\t' << found.expansions << '\t' << fixed << setprecision(3) << seconds;
+		return line.str();
+	}
+	catch (const exception& e)
+	{
+		failed = true;
+		return file + "\terror\t" + e.what();
+	}
+}
+
+int run_batch(const vector<string>& patterns, const BatchOptions& options)
+{
+	const vector<string> files = expand_patterns(patterns);
+
+	mutex batch_mutex;
+	condition_variable finished_cv; // notified whenever a factory is done
+	vector<string> results(files.size());
+	vector<bool> done(files.size(), false);
+	size_t next_job = 0, next_output = 0, running = 0, failures = 0;
+
+	cout << "# file\tcost\tlower-bound\tupgraded-facilities\tupgraded-lines\texpansions\tseconds" << endl;
+
+	auto worker = [&]()
+	{
+		while (true)
+		{
+			size_t i;
+			{
+				unique_lock<mutex> lock(batch_mutex);
+				// don't start another factory while memory is scarce. memory
+				// can be freed by other processes too, so look again from time to time.
+				while (next_job < files.size() && running > 0 && available_memory() < options.min_free_memory)
+					finished_cv.wait_for(lock, chrono::milliseconds(500));
+				if (next_job >= files.size())
+					return;
+				i = next_job++;
+				running++;
+			}
+
+			bool failed = false;
+			string line = solve(files[i], options, failed);
+
+			{
+				lock_guard<mutex> lock(batch_mutex);
+				running--;
+				if (failed)
+					failures++;
+				results[i] = move(line);
+				done[i] = true;
+
+				// keep the input order, but write out what we can right away
+				while (next_output < files.size() && done[next_output])
+				{
+					cout << results[next_output] << '\n';
+					results[next_output].clear();
+					next_output++;
+				}
+				cout.flush();
+			}
+			finished_cv.notify_all();
+		}
+	};
+
+	vector<thread> threads;
+	for (size_t i = 0; i < min(max<size_t>(options.n_threads, 1), files.size()); i++)
+		threads.emplace_back(worker);
+	for (auto& t : threads)
+		t.join();
+
+	return failures > 0 ? 1 : 0;
+}
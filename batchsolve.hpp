@@ -0,0 +1,36 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <cstddef>
+
+#include "actiongraph.hpp"
+
+struct BatchOptions
+{
+	size_t n_threads = 1;
+	ActionGraph::SearchLimits limits; // per factory
+	// the simulation cache of each factory's search. a worker searches its
+	// factory's islands one after another, so this is also the cache per worker.
+	size_t cache_bytes = size_t(256) << 20;
+
+	// another factory is only started while at least this many bytes of
+	// memory are available. the first one always is.
+	size_t min_free_memory = 0;
+};
+
+// optimizes many factories concurrently, one per worker thread, and writes
+// one tab separated line per factory to stdout, in the order they were given:
+//
+//   file  cost  lower-bound  upgraded-facilities  upgraded-lines  expansions  seconds
+//
+// the upgrades are listed as "index+levels", with one based indices like in
+// the .tgf file (transport lines are numbered in file order), or "-" if
+// there are none. a factory without a solution has a cost of "none", and
+// one that could not be optimized at all has "error" followed by the reason.
+//
+// patterns are file names or glob patterns. returns non-zero if any factory
+// failed with an error.
+int run_batch(const std::vector<std::string>& patterns, const BatchOptions& options);
+
+// the MemAvailable figure of /proc/meminfo, in bytes. 0 if unknown.
+size_t available_memory();
@@ -0,0 +1,252 @@
+#include <stdexcept>
+#include <iostream>
+#include <fstream>
+#include <iterator>
+#include <cstring>
+#include <cerrno>
+#include <cstdint>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+
+#include "checkpoint.hpp"
+
+using namespace std;
+
+static const char MAGIC[8] = {'P','F','C','K','P','T','0','3'};
+
+template <typename T> static void put(vector<char>& out, T value)
+{
+	const char* p = reinterpret_cast<const char*>(&value);
+	out.insert(out.end(), p, p + sizeof(T));
+}
+
+template <typename T> static T get(const vector<char>& in, size_t& pos)
+{
+	if (pos + sizeof(T) > in.size())
+		throw runtime_error("checkpoint is truncated");
+	T value;
+	memcpy(&value, in.data() + pos, sizeof(T));
+	pos += sizeof(T);
+	return value;
+}
+
+// levels are stored as 16 bit numbers, that's plenty
+static void put_levels(vector<char>& out, const vector<size_t>& levels)
+{
+	for (size_t level : levels)
+	{
+		if (level > UINT16_MAX)
+			throw runtime_error("upgrade level too large for a checkpoint");
+		put<uint16_t>(out, uint16_t(level));
+	}
+}
+
+static vector<size_t> get_levels(const vector<char>& in, size_t& pos, size_t n)
+{
+	vector<size_t> levels(n);
+	for (size_t& level : levels)
+		level = get<uint16_t>(in, pos);
+	return levels;
+}
+
+static void write_all(int fd, const vector<char>& out, const string& file)
+{
+	size_t written = 0;
+	while (written < out.size())
+	{
+		ssize_t n = write(fd, out.data() + written, out.size() - written);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+		{
+			int err = errno;
+			close(fd);
+			throw runtime_error("could not write '" + file + "': " + strerror(err));
+		}
+		written += size_t(n);
+	}
+}
+
+void SearchCheckpoint::save(const string& file) const
+{
+	// write to a temporary file and rename it, so that there's always a complete checkpoint
+	string tmp_file = file + ".tmp";
+	int fd = ::open(tmp_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		throw runtime_error("could not create '" + tmp_file + "': " + strerror(errno));
+
+	// the closed keys can be many, they're written out in pieces
+	const size_t CHUNK = size_t(1) << 20;
+	vector<char> out(MAGIC, MAGIC + sizeof(MAGIC));
+	put<uint64_t>(out, n_facilities);
+	put<uint64_t>(out, n_transport_lines);
+	put<uint64_t>(out, factory_fingerprint);
+	put_levels(out, initial_config.facility_levels);
+	put_levels(out, initial_config.transport_levels);
+	put<double>(out, best_cost);
+	if (best_cost >= 0.)
+	{
+		put_levels(out, best_conf.facility_levels);
+		put_levels(out, best_conf.transport_levels);
+	}
+	put<uint64_t>(out, expansions);
+
+	put<uint64_t>(out, closed.file.size());
+	out.insert(out.end(), closed.file.begin(), closed.file.end());
+	put<uint64_t>(out, closed.n_slots);
+	put<uint64_t>(out, closed.n_entries);
+	put<uint32_t>(out, closed.epoch);
+	if (closed.file.empty())
+	{
+		size_t n_keys = 0;
+		if (closed.table)
+			closed.for_each_key([&](const NodeKey& key)
+			{
+				put<uint64_t>(out, key.a);
+				put<uint64_t>(out, key.b);
+				n_keys++;
+				if (out.size() >= CHUNK)
+				{
+					write_all(fd, out, tmp_file);
+					out.clear();
+				}
+			});
+		if (n_keys != closed.n_entries)
+		{
+			close(fd);
+			throw runtime_error("closed list changed while writing the checkpoint");
+		}
+	}
+
+	put<uint64_t>(out, open.size());
+	for (const OpenNode& node : open)
+	{
+		put<int32_t>(out, node.current_item_type);
+		put<uint64_t>(out, node.current_component);
+		put<double>(out, node.total_cost);
+		put_levels(out, node.conf.facility_levels);
+		put_levels(out, node.conf.transport_levels);
+		if (out.size() >= CHUNK)
+		{
+			write_all(fd, out, tmp_file);
+			out.clear();
+		}
+	}
+
+	write_all(fd, out, tmp_file);
+	fsync(fd);
+	close(fd);
+
+	if (rename(tmp_file.c_str(), file.c_str()) != 0)
+		throw runtime_error("could not rename '" + tmp_file + "': " + strerror(errno));
+}
+
+SearchCheckpoint SearchCheckpoint::load(const string& file)
+{
+	ifstream f(file, ios::binary);
+	if (!f.good())
+		throw runtime_error("could not open checkpoint '" + file + "'");
+	vector<char> in((istreambuf_iterator<char>(f)), istreambuf_iterator<char>());
+
+	if (in.size() < sizeof(MAGIC) || memcmp(in.data(), MAGIC, sizeof(MAGIC)) != 0)
+		throw runtime_error("'" + file + "' is not a checkpoint");
+	size_t pos = sizeof(MAGIC);
+
+	SearchCheckpoint cp;
+	cp.n_facilities = get<uint64_t>(in, pos);
+	cp.n_transport_lines = get<uint64_t>(in, pos);
+	cp.factory_fingerprint = get<uint64_t>(in, pos);
+	cp.initial_config.facility_levels = get_levels(in, pos, cp.n_facilities);
+	cp.initial_config.transport_levels = get_levels(in, pos, cp.n_transport_lines);
+	cp.best_cost = get<double>(in, pos);
+	if (cp.best_cost >= 0.)
+	{
+		cp.best_conf.facility_levels = get_levels(in, pos, cp.n_facilities);
+		cp.best_conf.transport_levels = get_levels(in, pos, cp.n_transport_lines);
+	}
+	cp.expansions = get<uint64_t>(in, pos);
+
+	size_t file_length = get<uint64_t>(in, pos);
+	if (pos + file_length > in.size())
+		throw runtime_error("checkpoint is truncated");
+	cp.closed.file.assign(in.data() + pos, file_length);
+	pos += file_length;
+	cp.closed.n_slots = get<uint64_t>(in, pos);
+	cp.closed.n_entries = get<uint64_t>(in, pos);
+	cp.closed.epoch = get<uint32_t>(in, pos);
+	if (cp.closed.file.empty())
+	{
+		cp.closed_keys.resize(cp.closed.n_entries);
+		for (NodeKey& key : cp.closed_keys)
+		{
+			key.a = get<uint64_t>(in, pos);
+			key.b = get<uint64_t>(in, pos);
+		}
+	}
+
+	cp.open.resize(get<uint64_t>(in, pos));
+	for (OpenNode& node : cp.open)
+	{
+		node.current_item_type = item_t(get<int32_t>(in, pos));
+		node.current_component = get<uint64_t>(in, pos);
+		node.total_cost = get<double>(in, pos);
+		node.conf.facility_levels = get_levels(in, pos, cp.n_facilities);
+		node.conf.transport_levels = get_levels(in, pos, cp.n_transport_lines);
+	}
+
+	return cp;
+}
+
+
+CheckpointWriter::CheckpointWriter(string file_) : file(move(file_))
+{
+	writer_thread = thread(&CheckpointWriter::run, this);
+}
+
+CheckpointWriter::~CheckpointWriter()
+{
+	{
+		lock_guard<mutex> lock(pending_mutex);
+		stopping = true;
+	}
+	pending_cv.notify_one();
+	writer_thread.join();
+}
+
+void CheckpointWriter::submit(SearchCheckpoint checkpoint)
+{
+	{
+		lock_guard<mutex> lock(pending_mutex);
+		pending = move(checkpoint);
+		has_pending = true;
+	}
+	pending_cv.notify_one();
+}
+
+void CheckpointWriter::run()
+{
+	unique_lock<mutex> lock(pending_mutex);
+	while (true)
+	{
+		pending_cv.wait(lock, [this]{ return has_pending || stopping; });
+		if (!has_pending)
+			return;
+
+		SearchCheckpoint checkpoint = move(pending);
+		has_pending = false;
+		lock.unlock();
+
+		try
+		{
+			checkpoint.save(file);
+		}
+		catch (const exception& e)
+		{
+			cerr << "could not write checkpoint: " << e.what() << endl;
+		}
+
+		lock.lock();
+	}
+}
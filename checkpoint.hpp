@@ -0,0 +1,65 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "factory.hpp"
+#include "closedset.hpp"
+
+// the state of an ActionGraph search, from which it can be continued.
+struct SearchCheckpoint
+{
+	struct OpenNode
+	{
+		Factory::FactoryConfiguration conf;
+		item_t current_item_type;
+		size_t current_component;
+		double total_cost;
+	};
+
+	// for checking that the checkpoint belongs to the factory it's resumed with
+	size_t n_facilities = 0, n_transport_lines = 0;
+	uint64_t factory_fingerprint = 0; // Factory::fingerprint()
+
+	Factory::FactoryConfiguration initial_config;
+	Factory::FactoryConfiguration best_conf; // the best solution found so far, if best_cost >= 0
+	double best_cost = -1.;
+	size_t expansions = 0;
+
+	// a file-backed closed set stays in its file, and only the snapshot's
+	// file name and counts are stored. the keys of one in RAM are streamed
+	// into the checkpoint by save(); load() puts them into closed_keys.
+	ClosedSet::Snapshot closed;
+	std::vector<NodeKey> closed_keys;
+	std::vector<OpenNode> open;
+
+	// the file format is a compact binary one, in native byte order
+	void save(const std::string& file) const; // atomically replaces file
+	static SearchCheckpoint load(const std::string& file);
+};
+
+// writes checkpoints on a background thread, so the search isn't held up by
+// the disk. if the thread is still busy when the next checkpoint is
+// submitted, only the newest one is written.
+struct CheckpointWriter
+{
+	CheckpointWriter(std::string file_);
+	~CheckpointWriter(); // writes the pending checkpoint first
+	CheckpointWriter(const CheckpointWriter&) = delete;
+	CheckpointWriter& operator=(const CheckpointWriter&) = delete;
+
+	void submit(SearchCheckpoint checkpoint);
+
+	private:
+		void run();
+
+		std::string file;
+		std::mutex pending_mutex;
+		std::condition_variable pending_cv;
+		SearchCheckpoint pending;
+		bool has_pending = false;
+		bool stopping = false;
+		std::thread writer_thread;
+};
@@ -0,0 +1,190 @@
+#include <stdexcept>
+#include <cstring>
+#include <cerrno>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+
+#include "closedset.hpp"
+
+using namespace std;
+
+static const size_t INITIAL_CAPACITY = size_t(1) << 16;
+static const size_t SLOT_BYTES = sizeof(NodeKey) + sizeof(uint32_t);
+
+// a zeroed table of n_slots keys. with create == false, the table of an
+// existing file is mapped instead, and n_slots is taken from its size.
+ClosedSet::Table::Table(size_t n_slots_, const string& path, bool create) : n_slots(n_slots_)
+{
+	void* mem;
+
+	if (path.empty())
+		mem = mmap(nullptr, n_slots * SLOT_BYTES, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	else
+	{
+		fd = open(path.c_str(), create ? O_RDWR | O_CREAT | O_TRUNC : O_RDWR, 0644);
+		if (fd < 0)
+			throw runtime_error("could not " + string(create ? "create" : "open") + " '" + path + "': " + strerror(errno));
+		if (create && ftruncate(fd, off_t(n_slots * SLOT_BYTES)) != 0) // sparse, reads as zeroes
+		{
+			int err = errno;
+			close(fd);
+			throw runtime_error("could not resize '" + path + "': " + strerror(err));
+		}
+		if (!create)
+		{
+			struct stat st;
+			if (fstat(fd, &st) != 0)
+				st.st_size = 0;
+			n_slots = size_t(st.st_size) / SLOT_BYTES;
+			if (n_slots == 0 || (n_slots & (n_slots-1)) != 0 || n_slots * SLOT_BYTES != size_t(st.st_size))
+			{
+				close(fd);
+				throw runtime_error("'" + path + "' is not a closed list");
+			}
+		}
+		mem = mmap(nullptr, n_slots * SLOT_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	}
+
+	if (mem == MAP_FAILED)
+	{
+		int err = errno;
+		if (fd >= 0)
+			close(fd);
+		throw runtime_error(string("could not map the closed list: ") + strerror(err));
+	}
+
+	madvise(mem, n_slots * SLOT_BYTES, MADV_RANDOM); // hash table accesses are random, don't read ahead
+	keys = static_cast<NodeKey*>(mem);
+	epochs = reinterpret_cast<uint32_t*>(keys + n_slots);
+}
+
+ClosedSet::Table::~Table()
+{
+	munmap(keys, n_slots * SLOT_BYTES);
+	if (fd >= 0)
+		close(fd);
+}
+
+ClosedSet::ClosedSet(const string& file_) : file(file_)
+{
+	table = make_shared<Table>(INITIAL_CAPACITY, file, true);
+}
+
+ClosedSet::~ClosedSet()
+{
+	table.reset();
+	if (!file.empty() && !keep_file)
+		unlink(file.c_str());
+}
+
+bool ClosedSet::contains(NodeKey key) const
+{
+	size_t mask = table->n_slots - 1;
+	for (size_t i = key.a & mask; ; i = (i+1) & mask)
+	{
+		if (table->keys[i] == key)
+			return true;
+		if (table->keys[i].b == 0)
+			return false;
+	}
+}
+
+bool ClosedSet::insert(NodeKey key)
+{
+	if (2*(n_entries+1) > table->n_slots)
+		rehash(2*table->n_slots, epoch);
+
+	size_t mask = table->n_slots - 1;
+	for (size_t i = key.a & mask; ; i = (i+1) & mask)
+	{
+		if (table->keys[i] == key)
+			return false;
+		if (table->keys[i].b == 0)
+		{
+			// a snapshot being read on another thread only looks at the key
+			// once it sees the epoch
+			table->keys[i] = key;
+			__atomic_store_n(&table->epochs[i], epoch, __ATOMIC_RELEASE);
+			n_entries++;
+			return true;
+		}
+	}
+}
+
+ClosedSet::Snapshot ClosedSet::snapshot()
+{
+	Snapshot result;
+	result.n_slots = table->n_slots;
+	result.n_entries = n_entries;
+	result.epoch = epoch++;
+	if (file.empty())
+		result.table = table;
+	else
+	{
+		// only starts the writeback. if just the process dies, the page
+		// cache still has everything anyway.
+		msync(table->keys, table->n_slots * SLOT_BYTES, MS_ASYNC);
+		result.file = file;
+		keep_file = true;
+	}
+	return result;
+}
+
+void ClosedSet::restore(const Snapshot& snapshot)
+{
+	table.reset();
+	if (!file.empty() && !keep_file)
+		unlink(file.c_str());
+	file = snapshot.file;
+	keep_file = true;
+	table = make_shared<Table>(0, file, false);
+
+	size_t n_old = 0, n_new = 0;
+	for (size_t i = 0; i < table->n_slots; i++)
+		if (table->epochs[i] > snapshot.epoch)
+			n_new++;
+		else if (table->epochs[i] != 0)
+			n_old++;
+	if (table->n_slots < snapshot.n_slots || n_old != snapshot.n_entries)
+		throw runtime_error("closed list '" + file + "' doesn't match the checkpoint");
+
+	n_entries = n_old;
+	if (n_new)
+		rehash(table->n_slots, snapshot.epoch);
+	epoch = snapshot.epoch + 1;
+}
+
+// moves the entries of epochs up to max_epoch into a new table. with a file,
+// the new table is built next to the old one and then renamed over it.
+void ClosedSet::rehash(size_t new_capacity, uint32_t max_epoch)
+{
+	string new_file = file.empty() ? "" : file + ".tmp";
+	auto new_table = make_shared<Table>(new_capacity, new_file, true);
+
+	n_entries = 0;
+	for (size_t j = 0; j < table->n_slots; j++)
+	{
+		const NodeKey& key = table->keys[j];
+		uint32_t e = table->epochs[j];
+		if (e == 0 || e > max_epoch)
+			continue;
+		size_t i = key.a & (new_capacity-1);
+		while (new_table->keys[i].b != 0)
+			i = (i+1) & (new_capacity-1);
+		new_table->keys[i] = key;
+		new_table->epochs[i] = e;
+		n_entries++;
+	}
+
+	table = new_table; // a snapshot may still be reading the old one
+	if (!file.empty() && rename(new_file.c_str(), file.c_str()) != 0)
+	{
+		// just keep using the new table under its temporary name
+		unlink(file.c_str());
+		file = new_file;
+	}
+}
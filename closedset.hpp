@@ -0,0 +1,90 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <memory>
+
+// 128 bit hash of a search node, see ActionGraph::Node::key(). never {0, 0}.
+struct NodeKey
+{
+	uint64_t a, b;
+
+	bool operator==(const NodeKey& other) const { return a == other.a && b == other.b; }
+	struct hash { size_t operator()(const NodeKey& key) const { return size_t(key.a); } };
+};
+
+// the keys of all nodes the search has expanded, in an open addressing hash
+// table. the table lives in anonymous memory, or, if a file is given, in a
+// shared mapping of that file, which the kernel can write out to disk and
+// evict when memory gets scarce. the file is removed again by the destructor,
+// unless a checkpoint refers to it (see snapshot() and restore()).
+struct ClosedSet
+{
+	private:
+		// the keys, followed by the epoch each key was inserted in (0 for
+		// empty slots), in a single mapping. unmapped by the destructor, so
+		// that a Snapshot can keep reading a table that has been grown out of.
+		struct Table
+		{
+			Table(size_t n_slots_, const std::string& path, bool create);
+			~Table();
+			Table(const Table&) = delete;
+			Table& operator=(const Table&) = delete;
+
+			NodeKey* keys;
+			uint32_t* epochs;
+			size_t n_slots; // always a power of two
+			int fd = -1;
+		};
+
+	public:
+		explicit ClosedSet(const std::string& file_ = "");
+		~ClosedSet();
+		ClosedSet(const ClosedSet&) = delete;
+		ClosedSet& operator=(const ClosedSet&) = delete;
+
+		bool insert(NodeKey key); // returns false if key was already contained
+		bool contains(NodeKey key) const;
+		size_t size() const { return n_entries; }
+
+		// the set as it was when snapshot() was called. taking one is cheap:
+		// it only starts a new epoch, so that later insertions can be told
+		// apart. a file-backed set is only referred to by its file name, which
+		// is then kept on disk; the keys of a set in RAM are read by for_each_key(),
+		// which may run on another thread while the set is being inserted into.
+		struct Snapshot
+		{
+			std::string file; // empty for sets in RAM
+			size_t n_slots = 0, n_entries = 0;
+			uint32_t epoch = 0; // the entries of this epoch and the ones before
+
+			template <typename F> void for_each_key(F f) const
+			{
+				for (size_t i = 0; i < table->n_slots; i++)
+				{
+					uint32_t e = __atomic_load_n(&table->epochs[i], __ATOMIC_ACQUIRE);
+					if (e != 0 && e <= epoch)
+						f(table->keys[i]);
+				}
+			}
+
+			std::shared_ptr<const Table> table; // only for sets in RAM
+		};
+		Snapshot snapshot();
+
+		// replaces the (empty) set by the file-backed one of a snapshot, without
+		// the entries that were inserted after the snapshot was taken. throws
+		// if the file doesn't match the snapshot.
+		void restore(const Snapshot& snapshot);
+
+	private:
+		std::string file;
+		bool keep_file = false;
+		std::shared_ptr<Table> table;
+		size_t n_entries = 0;
+		uint32_t epoch = 1;
+
+		void rehash(size_t new_capacity, uint32_t max_epoch);
+};
@@ -0,0 +1,2 @@
+# possible values: GCC, clang
+COMPILER=GCC
@@ -0,0 +1,283 @@
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include <cstdio>
+
+#include "export.hpp"
+
+using namespace std;
+
+void OutputBuffer::flush()
+{
+	out.write(buffer, streamsize(used));
+	used = 0;
+}
+
+OutputBuffer& OutputBuffer::operator<<(unsigned long long value)
+{
+	char digits[20];
+	char* p = digits + sizeof(digits);
+	do
+	{
+		*--p = char('0' + value % 10);
+		value /= 10;
+	} while (value);
+	write(p, size_t(digits + sizeof(digits) - p));
+	return *this;
+}
+
+OutputBuffer& OutputBuffer::operator<<(long long value)
+{
+	if (value < 0)
+	{
+		*this << '-';
+		return *this << (0ull - (unsigned long long)value);
+	}
+	return *this << (unsigned long long)value;
+}
+
+
+OutputBuffer& OutputBuffer::operator<<(double value)
+{
+	char digits[32];
+	int n = snprintf(digits, sizeof(digits), "%.6g", value);
+	write(digits, size_t(n));
+	return *this;
+}
+
+// edge_from[e] and edge_to[e] for all edges at once. FlowGraph::edge_from()
+// searches all nodes for every single edge.
+static void edge_endpoints(const FlowGraph& flowgraph, vector<size_t>& from, vector<size_t>& to)
+{
+	from.assign(flowgraph.edges.size(), SIZE_MAX);
+	to.assign(flowgraph.edges.size(), SIZE_MAX);
+	auto index = [&](const FlowGraph::Edge* edge)
+	{
+		size_t e = size_t(edge - flowgraph.edges.data());
+		if (e >= flowgraph.edges.size())
+			throw runtime_error("FlowGraph is corrupt");
+		return e;
+	};
+	for (size_t i = 0; i < flowgraph.nodes.size(); i++)
+	{
+		for (const FlowGraph::Edge* edge : flowgraph.nodes[i].outgoing_edges)
+			from[index(edge)] = i;
+		for (const FlowGraph::Edge* edge : flowgraph.nodes[i].incoming_edges)
+			to[index(edge)] = i;
+	}
+	for (size_t e = 0; e < flowgraph.edges.size(); e++)
+		if (from[e] == SIZE_MAX || to[e] == SIZE_MAX)
+			throw runtime_error("FlowGraph is corrupt");
+}
+
+void write_dot(OutputBuffer& out, const FlowGraph& flowgraph, const string& name)
+{
+	out << "digraph \"" << name << "\" {\n";
+
+	for (size_t i = 0; i < flowgraph.nodes.size(); i++)
+	{
+		const auto& node = flowgraph.nodes[i];
+		rate_t incoming = node.incoming();
+		out << '\t' << i << " [";
+		if (incoming < -node.max_production)
+			out << "color=red,";
+		else if (node.excess > 0)
+			out << "color=blue,";
+		out << "label=\"" << incoming << "in, " << node.actual_production << '/' << node.max_production << "prod\\n"
+		    << node.available() << "avail, " << node.excess << "exc\"];\n";
+	}
+
+	out << '\n';
+
+	vector<size_t> from, to;
+	edge_endpoints(flowgraph, from, to);
+	for (size_t e = 0; e < flowgraph.edges.size(); e++)
+	{
+		const auto& edge = flowgraph.edges[e];
+		out << '\t' << from[e] << " -> " << to[e] << " [";
+		if (edge.actual_flow > edge.actual_capacity)
+			out << "color=red,";
+		out << "label=\"" << edge.actual_flow << '/' << edge.actual_capacity << '(' << edge.capacity << ")\"];\n";
+	}
+
+	out << "}\n";
+}
+
+// the flowgraph node of facility i for item
+static const FlowGraph::Node& node_of(const Factory& factory, const vector<FlowGraph>& flowgraphs, size_t i, item_t item)
+{
+	return flowgraphs[item].nodes[factory.facility_toposort_inv[item][i]];
+}
+
+static const FlowGraph::Edge& edge_of(const Factory& factory, const vector<FlowGraph>& flowgraphs, size_t i)
+{
+	item_t item = factory.transport_lines[i].item_type;
+	return flowgraphs[item].edges[factory.edge_table_per_item_inv[item][i]];
+}
+
+// a consumer which is getting not enough input
+static bool unsatisfied(const FlowGraph::Node& node)
+{
+	return node.max_production < 0 && -node.actual_production < -node.max_production;
+}
+
+// with coupled flows, a facility that runs below its throughput because
+// nobody needs its outputs is fine; only a starved one is unsatisfied.
+static bool facility_unsatisfied(const Factory& factory, const vector<FlowGraph>& flowgraphs,
+	const Factory::CoupledResult* coupled, size_t i)
+{
+	if (coupled)
+		return coupled->starved[i];
+	for (item_t item : factory.facilities[i].items)
+		if (unsatisfied(node_of(factory, flowgraphs, i, item)))
+			return true;
+	return false;
+}
+
+static void write_dot(OutputBuffer& out, const Factory& factory, const vector<FlowGraph>& flowgraphs,
+	const Factory::CoupledResult* coupled)
+{
+	out << "digraph \"factory\" {\n";
+
+	for (size_t i = 0; i < factory.facilities.size(); i++)
+	{
+		out << '\t' << i << " [label=\"";
+		for (item_t item : factory.facilities[i].items)
+		{
+			const auto& node = node_of(factory, flowgraphs, i, item);
+			if (node.max_production != 0)
+				out << item_name.at(item) << ':' << node.actual_production << '/' << node.max_production << ", ";
+		}
+		out << '"';
+
+		if (facility_unsatisfied(factory, flowgraphs, coupled, i))
+			out << ", color=red";
+
+		out << "];\n";
+	}
+
+	out << '\n';
+
+	for (size_t i = 0; i < factory.transport_lines.size(); i++)
+	{
+		const auto& tl = factory.transport_lines[i];
+		const auto& edge = edge_of(factory, flowgraphs, i);
+		out << '\t' << tl.from << " -> " << tl.to << " [label=\"" << item_name.at(tl.item_type) << ": " << edge.actual_flow << '/' << edge.capacity << "\"];\n";
+	}
+	out << "}\n";
+}
+
+void write_dot(OutputBuffer& out, const Factory& factory, const vector<FlowGraph>& flowgraphs)
+{
+	write_dot(out, factory, flowgraphs, nullptr);
+}
+
+void write_dot(OutputBuffer& out, const Factory& factory, const Factory::CoupledResult& coupled)
+{
+	write_dot(out, factory, coupled.flowgraphs, &coupled);
+}
+
+static void write_json(OutputBuffer& out, const Factory& factory, const Factory::FactoryConfiguration& conf,
+	const vector<FlowGraph>& flowgraphs, const Factory::CoupledResult* coupled)
+{
+	bool valid = true;
+	if (coupled)
+	{
+		for (bool starved : coupled->starved)
+			if (starved)
+				valid = false;
+	}
+	else
+	{
+		for (const auto& flowgraph : flowgraphs)
+			if (!flowgraph.is_valid())
+				valid = false;
+	}
+
+	out << "{\"valid\": " << (valid ? "true" : "false") << ",\n\"facilities\": [";
+	for (size_t i = 0; i < factory.facilities.size(); i++)
+	{
+		bool satisfied = !facility_unsatisfied(factory, flowgraphs, coupled, i);
+
+		out << (i ? ",\n" : "\n") << "{\"level\": " << conf.facility_levels[i]
+		    << ", \"satisfied\": " << (satisfied ? "true" : "false");
+		if (coupled)
+			out << ", \"utilization\": " << coupled->utilization[i];
+		out << ", \"items\": [";
+		bool first = true;
+		for (item_t item : factory.facilities[i].items)
+		{
+			const auto& node = node_of(factory, flowgraphs, i, item);
+			if (node.max_production == 0)
+				continue;
+			out << (first ? "" : ", ") << "{\"item\": \"" << item_name.at(item) << "\", \"production\": "
+			    << node.actual_production << ", \"max_production\": " << node.max_production << '}';
+			first = false;
+		}
+		out << "]}";
+	}
+
+	out << "],\n\"transport_lines\": [";
+	for (size_t i = 0; i < factory.transport_lines.size(); i++)
+	{
+		const auto& tl = factory.transport_lines[i];
+		const auto& edge = edge_of(factory, flowgraphs, i);
+		out << (i ? ",\n" : "\n") << "{\"from\": " << tl.from << ", \"to\": " << tl.to
+		    << ", \"item\": \"" << item_name.at(tl.item_type) << "\", \"level\": " << conf.transport_levels[i]
+		    << ", \"flow\": " << edge.actual_flow << ", \"capacity\": " << edge.capacity << '}';
+	}
+	out << "]}\n";
+}
+
+void write_json(OutputBuffer& out, const Factory& factory, const Factory::FactoryConfiguration& conf,
+	const vector<FlowGraph>& flowgraphs)
+{
+	write_json(out, factory, conf, flowgraphs, nullptr);
+}
+
+void write_json(OutputBuffer& out, const Factory& factory, const Factory::FactoryConfiguration& conf,
+	const Factory::CoupledResult& coupled)
+{
+	write_json(out, factory, conf, coupled.flowgraphs, &coupled);
+}
+
+static const char MAGIC[8] = {'P','F','F','L','O','W','0','2'};
+
+void write_binary(OutputBuffer& out, const Factory& factory, const Factory::FactoryConfiguration& conf,
+	const vector<FlowGraph>& flowgraphs)
+{
+	out.write(MAGIC, sizeof(MAGIC));
+	out.raw<uint64_t>(factory.facilities.size());
+	out.raw<uint64_t>(factory.transport_lines.size());
+	out.raw<int64_t>(SCALING_FACTOR);
+
+	for (size_t i = 0; i < factory.facilities.size(); i++)
+	{
+		out.raw<uint16_t>(uint16_t(conf.facility_levels[i]));
+
+		uint8_t n_items = 0;
+		for (item_t item : factory.facilities[i].items)
+			if (node_of(factory, flowgraphs, i, item).max_production != 0)
+				n_items++;
+		out.raw<uint8_t>(n_items);
+
+		for (item_t item : factory.facilities[i].items)
+		{
+			const auto& node = node_of(factory, flowgraphs, i, item);
+			if (node.max_production == 0)
+				continue;
+			out.raw<uint8_t>(uint8_t(item));
+			out.raw<int64_t>(node.actual_production);
+			out.raw<int64_t>(node.max_production);
+		}
+	}
+
+	for (size_t i = 0; i < factory.transport_lines.size(); i++)
+	{
+		const auto& edge = edge_of(factory, flowgraphs, i);
+		out.raw<uint16_t>(uint16_t(conf.transport_levels[i]));
+		out.raw<uint8_t>(uint8_t(factory.transport_lines[i].item_type));
+		out.raw<int64_t>(edge.actual_flow);
+		out.raw<int64_t>(edge.capacity);
+	}
+}
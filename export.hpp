@@ -0,0 +1,85 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <ostream>
+#include <cstdint>
+#include <cstring>
+
+#include "flowgraph.hpp"
+#include "factory.hpp"
+
+// collects output in a large buffer and hands it to the stream in big
+// chunks, instead of formatting and flushing every value and line on its
+// own. integers are formatted by hand, which is much faster than iostreams.
+struct OutputBuffer
+{
+	explicit OutputBuffer(std::ostream& out_) : out(out_) {}
+	~OutputBuffer() { flush(); }
+	OutputBuffer(const OutputBuffer&) = delete;
+	OutputBuffer& operator=(const OutputBuffer&) = delete;
+
+	void flush(); // passes everything on to the stream, but doesn't flush that
+
+	void write(const char* data, size_t n)
+	{
+		if (used + n > SIZE)
+		{
+			flush();
+			if (n > SIZE)
+			{
+				out.write(data, std::streamsize(n));
+				return;
+			}
+		}
+		memcpy(buffer + used, data, n);
+		used += n;
+	}
+
+	// the value's bytes in native byte order, for binary formats
+	template <typename T> void raw(T value) { write(reinterpret_cast<const char*>(&value), sizeof(T)); }
+
+	OutputBuffer& operator<<(char c) { write(&c, 1); return *this; }
+	OutputBuffer& operator<<(const char* s) { write(s, strlen(s)); return *this; }
+	OutputBuffer& operator<<(const std::string& s) { write(s.data(), s.size()); return *this; }
+	OutputBuffer& operator<<(long long value);
+	OutputBuffer& operator<<(unsigned long long value);
+	OutputBuffer& operator<<(int value) { return *this << (long long)value; }
+	OutputBuffer& operator<<(long value) { return *this << (long long)value; }
+	OutputBuffer& operator<<(unsigned value) { return *this << (unsigned long long)value; }
+	OutputBuffer& operator<<(unsigned long value) { return *this << (unsigned long long)value; }
+	OutputBuffer& operator<<(double value); // like printf's %.6g
+
+	private:
+		static const size_t SIZE = 1 << 16;
+
+		std::ostream& out;
+		char buffer[SIZE];
+		size_t used = 0;
+};
+
+// graphviz dot, as FlowGraph::dump() and Factory::simulate_debug() print them
+void write_dot(OutputBuffer& out, const FlowGraph& flowgraph, const std::string& name);
+void write_dot(OutputBuffer& out, const Factory& factory, const std::vector<FlowGraph>& flowgraphs);
+void write_dot(OutputBuffer& out, const Factory& factory, const Factory::CoupledResult& coupled); // only starved facilities are red
+
+// the simulated flows of a whole factory, as returned by Factory::simulate().
+//
+// json: {"valid": bool, "facilities": [{"level", "satisfied", "items": [{"item",
+// "production", "max_production"}]}], "transport_lines": [{"from", "to",
+// "item", "level", "flow", "capacity"}]}, with items given by name.
+//
+// binary: the magic "PFFLOW02", then uint64 counts of facilities and transport
+// lines, and the int64 SCALING_FACTOR of the rates. every facility is a uint16
+// level, a uint8 number of items and, for each item, a uint8 item type and
+// int64 actual and maximum production. every transport line is a uint16 level,
+// a uint8 item type and int64 flow and capacity. all in native byte order.
+void write_json(OutputBuffer& out, const Factory& factory, const Factory::FactoryConfiguration& conf,
+	const std::vector<FlowGraph>& flowgraphs);
+// the coupled flows of Factory::simulate_coupled(). json then also gives every
+// facility's "utilization", and "satisfied" is false only for facilities that
+// are starved of an input. one that runs below 1 because its outputs aren't
+// needed downstream is satisfied, so "valid" means that no facility is starved.
+void write_json(OutputBuffer& out, const Factory& factory, const Factory::FactoryConfiguration& conf,
+	const Factory::CoupledResult& coupled);
+void write_binary(OutputBuffer& out, const Factory& factory, const Factory::FactoryConfiguration& conf,
+	const std::vector<FlowGraph>& flowgraphs);
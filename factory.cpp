@@ -1,9 +1,16 @@
 #include "flowgraph.hpp"
 #include "factory.hpp"
+#include "export.hpp"
+#include "parallel.hpp"
 
 #include <string>
 #include <cassert>
 #include <iostream>
+#include <deque>
+#include <algorithm>
+#include <mutex>
+#include <thread>
+#include <cstring>
 
 using namespace std;
 
@@ -24,58 +31,106 @@ map<item_t, string> item_name =
 
 const size_t INVALID_INDEX = SIZE_MAX;
 
-vector<size_t> Factory::collect_relevant_facilities(item_t item) const
+// the interned plans. a deque never moves its elements, so the pointers
+// handed out stay valid.
+static mutex plans_mutex;
+static deque<Factory::FacilityPlan> facility_plans;
+static deque<Factory::TransportPlan> transport_plans;
+
+template <typename Plan> static const Plan* intern_plan(deque<Plan>& plans, Plan plan)
 {
-	vector<size_t> relevant_facilities;
+	lock_guard<mutex> lock(plans_mutex);
+	for (const auto& existing : plans)
+		if (existing == plan)
+			return &existing;
+	plans.push_back(move(plan));
+	return &plans.back();
+}
 
-	for (size_t facility_id = 0; facility_id < facilities.size(); facility_id++)
-	{
-		const auto& facility = facilities[facility_id];
+const Factory::FacilityPlan* Factory::intern(FacilityPlan plan)
+{
+	return intern_plan(facility_plans, move(plan));
+}
 
-		if (facility.items.find(item) != facility.items.end())
-		{
-			relevant_facilities.push_back(facility_id);
-		}
-		#ifndef NDEBUG
-		else // assert that there is no `item`-edge from or to that facility
-		{
-			for (const auto& transport_line : transport_lines)
-				if (transport_line.item_type == item)
-					assert(transport_line.from != facility_id
-						&& transport_line.to != facility_id);
-		}
-		#endif
-	}
-	
-	return relevant_facilities;
+const Factory::TransportPlan* Factory::intern(TransportPlan plan)
+{
+	return intern_plan(transport_plans, move(plan));
 }
 
-static size_t pop_root_node(vector<size_t>& relevant_facilities, const vector< unordered_set<size_t> >& incident_edges)
+bool Factory::TransportPlan::operator==(const TransportPlan& other) const
 {
-	for (size_t& facility_id : relevant_facilities)
-		if (incident_edges[facility_id].empty())
-		{
-			size_t result = facility_id;
+	if (tiers.size() != other.tiers.size())
+		return false;
+	for (size_t i = 0; i < tiers.size(); i++)
+		if (tiers[i].capacity != other.tiers[i].capacity || tiers[i].incremental_cost != other.tiers[i].incremental_cost)
+			return false;
+	return true;
+}
 
-			facility_id = relevant_facilities.back();
-			relevant_facilities.pop_back();
+rate_t Factory::Facility::production(size_t level, item_t item) const
+{
+	for (const auto& itemrate : plan->recipe)
+		if (itemrate.first == item)
+			return rate_t(itemrate.second * (current + (maximum-current) * double(level) / double(levels())));
+	return 0;
+}
 
-			return result;
-		}
+ItemSet Factory::Facility::plan_items() const
+{
+	ItemSet result;
+	for (const auto& itemrate : plan->recipe)
+		for (size_t level = 0; level < levels(); level++)
+			if (production(level, itemrate.first) != 0)
+				result.insert(itemrate.first);
+	return result;
+}
 
-	return INVALID_INDEX;
+static size_t find_root(vector<size_t>& parent, size_t i)
+{
+	while (parent[i] != i)
+	{
+		parent[i] = parent[parent[i]]; // path halving
+		i = parent[i];
+	}
+	return i;
 }
 
-void Factory::initialize()
+static void unite(vector<size_t>& parent, size_t a, size_t b)
 {
+	a = find_root(parent, a);
+	b = find_root(parent, b);
+	if (a != b)
+		parent[max(a,b)] = min(a,b);
+}
+
+void Factory::initialize(size_t n_threads)
+{
+	if (n_threads == 0)
+		n_threads = max(1u, thread::hardware_concurrency());
+	n_threads = min<size_t>(n_threads, MAX_ITEM);
+	// threads only pay off for large factories
+	if (facilities.size() + transport_lines.size() < 100000)
+		n_threads = 1;
+
 	build_facility_itemset();
-	build_topological_sort();
 	build_edge_table();
+	build_topological_sort(n_threads);
+	build_components(n_threads);
+	build_relevance_masks();
+
+	item_revision.resize(MAX_ITEM);
+	for (int item = 0; item < MAX_ITEM; item++)
+		touch(item_t(item));
 }
 
 // marks all facilities relevant for $item, if they have an $item-edge
 void Factory::build_facility_itemset()
 {
+	// start over from the items the facilities produce or consume, in case
+	// transport lines have been removed since the last call.
+	for (auto& fac : facilities)
+		fac.items = fac.plan_items();
+
 	for (const auto& tl : transport_lines)
 	{
 		facilities[tl.from].items.insert(tl.item_type);
@@ -83,82 +138,238 @@ void Factory::build_facility_itemset()
 	}
 
 	for (auto& fac : facilities)
-		fac.most_advanced_item_involved = *fac.items.rbegin();
+		fac.most_advanced_item_involved = fac.items.most_advanced();
 }
 
-void Factory::build_topological_sort()
+void Factory::build_relevance_masks()
 {
-	facility_toposort.resize(MAX_ITEM);
-	facility_toposort_inv.resize(MAX_ITEM);
+	facility_relevance.assign(MAX_ITEM+1, {});
+	transport_relevance.assign(MAX_ITEM+1, {});
+	resize_relevance_masks();
+	for (size_t i = 0; i < facilities.size(); i++)
+		update_relevance(facility_relevance, i, facilities[i].most_advanced_item_involved);
+	for (size_t i = 0; i < transport_lines.size(); i++)
+		update_relevance(transport_relevance, i, transport_lines[i].item_type);
+}
 
-	for (int item = 0; item < MAX_ITEM; item++)
+// adapts the masks to the number of facilities and transport lines. bits
+// beyond the end are cleared.
+void Factory::resize_relevance_masks()
+{
+	auto resize = [](vector< vector<uint64_t> >& masks, size_t n)
 	{
-		vector<size_t>& toposort = facility_toposort[item];
-		vector<size_t>& toposort_inv = facility_toposort_inv[item];
-		toposort.clear();
-		toposort_inv.resize(facilities.size());
+		for (auto& mask : masks)
+		{
+			mask.resize((n + 63) / 64);
+			if (n % 64)
+				mask.back() &= (uint64_t(1) << (n % 64)) - 1;
+		}
+	};
+	resize(facility_relevance, facilities.size());
+	resize(transport_relevance, transport_lines.size());
+}
 
+// the entity at index is relevant from first_relevant_item on
+void Factory::update_relevance(vector< vector<uint64_t> >& masks, size_t index, item_t first_relevant_item)
+{
+	const uint64_t bit = uint64_t(1) << (index % 64);
+	for (int item = DONE; item < MAX_ITEM; item++)
+	{
+		uint64_t& word = masks[size_t(item+1)][index / 64];
+		if (item >= first_relevant_item)
+			word |= bit;
+		else
+			word &= ~bit;
+	}
+}
 
-		vector<size_t> relevant_facilities = collect_relevant_facilities(item_t(item));
+// the same order as taking the first facility without incoming edges from
+// relevant_facilities over and over, and moving the last one into its place.
+// a sorted set of the positions of these roots finds the first one without
+// searching. in_degree and position are scratch space with an entry for
+// every facility, all zero in in_degree. they're left that way.
+static void topological_sort(item_t item, vector<size_t> relevant_facilities,
+	const vector<Factory::TransportLine>& transport_lines, const vector<size_t>& edge_table,
+	const vector< vector<size_t> >& facility_outgoing,
+	vector<size_t>& in_degree, vector<size_t>& position,
+	vector<size_t>& toposort, vector<size_t>& toposort_inv)
+{
+	for (size_t edge_id : edge_table)
+		if (++in_degree[transport_lines[edge_id].to] > MAX_FAN_IN)
+			throw runtime_error("facility " + to_string(transport_lines[edge_id].to) + " has more than "
+				+ to_string(MAX_FAN_IN) + " incoming transport lines for item " + to_string(item));
+
+	set<size_t> roots;
+	for (size_t i = 0; i < relevant_facilities.size(); i++)
+	{
+		position[relevant_facilities[i]] = i;
+		if (in_degree[relevant_facilities[i]] == 0)
+			roots.insert(roots.end(), i);
+	}
+
+	while (!roots.empty())
+	{
+		size_t i = *roots.begin();
+		roots.erase(roots.begin());
 
+		size_t root = relevant_facilities[i];
+		toposort.push_back(root);
+		toposort_inv[root] = toposort.size()-1;
 
-		// calculate incident / outgoing edges
-		vector< unordered_set<size_t> > incident_edges(facilities.size());
-		vector< unordered_set<size_t> > outgoing_edges(facilities.size());
-		for (size_t edge_id = 0; edge_id < transport_lines.size(); edge_id++)
+		size_t last = relevant_facilities.size()-1;
+		if (i != last)
 		{
-			const auto& edge = transport_lines[edge_id];
+			relevant_facilities[i] = relevant_facilities[last];
+			position[relevant_facilities[i]] = i;
+			if (roots.erase(last))
+				roots.insert(i);
+		}
+		relevant_facilities.pop_back();
 
-			if (edge.item_type == item)
-			{
-				incident_edges[edge.to].insert(edge_id);
-				outgoing_edges[edge.from].insert(edge_id);
-			}
+		for (size_t edge_id : facility_outgoing[root])
+		{
+			const auto& edge = transport_lines[edge_id];
+			if (edge.item_type == item && --in_degree[edge.to] == 0)
+				roots.insert(position[edge.to]);
 		}
+	}
 
+	if (!relevant_facilities.empty())
+		throw runtime_error("Factory is not a directed acyclic graph for item " + to_string(item));
+}
 
-		// do the actual topological sorting
-		size_t root;
-		while ((root = pop_root_node(relevant_facilities, incident_edges)) != INVALID_INDEX)
-		{
-			toposort.push_back(root);
-			toposort_inv[root] = toposort.size()-1;
+void Factory::build_topological_sort(size_t n_threads)
+{
+	facility_toposort.resize(MAX_ITEM);
+	facility_toposort_inv.resize(MAX_ITEM);
+
+	// the facilities relevant for each item, in one pass
+	vector< vector<size_t> > relevant_facilities(MAX_ITEM);
+	for (size_t facility_id = 0; facility_id < facilities.size(); facility_id++)
+		for (item_t item : facilities[facility_id].items)
+			relevant_facilities[item].push_back(facility_id);
 
-			for (size_t edge_id : outgoing_edges[root])
-				incident_edges[transport_lines[edge_id].to].erase(edge_id);
+	vector< vector<size_t> > in_degree(n_threads), position(n_threads);
+	parallel_for(MAX_ITEM, n_threads, [&](size_t item, size_t thread_index)
+	{
+		if (in_degree[thread_index].size() != facilities.size())
+		{
+			in_degree[thread_index].assign(facilities.size(), 0);
+			position[thread_index].resize(facilities.size());
 		}
 
-		for (const auto& edges : incident_edges)
-			if (!edges.empty())
-				throw runtime_error("Factory is not a directed acyclic graph for item " + to_string(item));
-	}
+		facility_toposort[item].clear();
+		facility_toposort_inv[item].resize(facilities.size());
+		topological_sort(item_t(item), move(relevant_facilities[item]), transport_lines,
+			edge_table_per_item[item], facility_outgoing, in_degree[thread_index], position[thread_index],
+			facility_toposort[item], facility_toposort_inv[item]);
+	});
 }
 
+// sorts the transport lines by item and by facility, in one pass
 void Factory::build_edge_table()
 {
 	edge_table_per_item.resize(MAX_ITEM);
 	edge_table_per_item_inv.resize(MAX_ITEM);
-
 	for (size_t item = 0; item < MAX_ITEM; item++)
 	{
 		edge_table_per_item[item].clear();
 		edge_table_per_item_inv[item].resize(transport_lines.size());
+	}
+
+	facility_outgoing.assign(facilities.size(), vector<size_t>());
+	facility_incoming.assign(facilities.size(), vector<size_t>());
+	for (size_t i = 0; i < transport_lines.size(); i++)
+	{
+		const auto& tl = transport_lines[i];
+		// build_facility_itemset() has seen to that
+		assert(facilities[tl.from].items.contains(tl.item_type) && facilities[tl.to].items.contains(tl.item_type));
+
+		facility_outgoing[tl.from].push_back(i);
+		facility_incoming[tl.to].push_back(i);
+		edge_table_per_item[tl.item_type].push_back(i);
+		edge_table_per_item_inv[tl.item_type][i] = edge_table_per_item[tl.item_type].size()-1;
+	}
+}
+
+// splits every item's flowgraph into its weakly connected components
+void Factory::build_components(size_t n_threads)
+{
+	components_per_item.resize(MAX_ITEM);
+	component_of_facility.resize(MAX_ITEM);
+	component_facility_inv.resize(MAX_ITEM);
+	component_edge_inv.resize(MAX_ITEM);
+
+	vector< vector<size_t> > parents(n_threads), components_of_root(n_threads);
+	parallel_for(MAX_ITEM, n_threads, [&](size_t item, size_t thread_index)
+	{
+		vector<size_t>& parent = parents[thread_index];
+		vector<size_t>& component_of_root = components_of_root[thread_index];
+		parent.resize(facilities.size());
+		component_of_root.resize(facilities.size());
+
+		auto& components = components_per_item[item];
+		components.clear();
+		component_of_facility[item].resize(facilities.size());
+		component_facility_inv[item].resize(facilities.size());
+		component_edge_inv[item].resize(transport_lines.size());
+
+		for (size_t facility_id : facility_toposort[item])
+		{
+			parent[facility_id] = facility_id;
+			component_of_root[facility_id] = INVALID_INDEX;
+		}
+		for (size_t edge_id : edge_table_per_item[item])
+			unite(parent, transport_lines[edge_id].from, transport_lines[edge_id].to);
 
-		for (size_t i = 0; i < transport_lines.size(); i++)
-			if (transport_lines[i].item_type == item)
+		// number the components in toposort order, so that each
+		// component's facility list stays topologically sorted.
+		for (size_t facility_id : facility_toposort[item])
+		{
+			size_t root = find_root(parent, facility_id);
+			if (component_of_root[root] == INVALID_INDEX)
 			{
-				edge_table_per_item[item].push_back(i);
-				edge_table_per_item_inv[item][i] = edge_table_per_item[item].size()-1;
+				component_of_root[root] = components.size();
+				components.emplace_back();
 			}
-	}
+			auto& component = components[component_of_root[root]];
+			component_of_facility[item][facility_id] = component_of_root[root];
+			component_facility_inv[item][facility_id] = component.facilities.size();
+			component.facilities.push_back(facility_id);
+		}
+
+		for (size_t edge_id : edge_table_per_item[item])
+		{
+			auto& component = components[component_of_root[find_root(parent, transport_lines[edge_id].from)]];
+			component_edge_inv[item][edge_id] = component.transport_lines.size();
+			component.transport_lines.push_back(edge_id);
+		}
+	});
+}
+
+rate_t Factory::production_rate(size_t facility_index, size_t level, item_t item) const
+{
+	return facilities[facility_index].production(level, item);
 }
 
 FlowGraph Factory::build_flowgraph(item_t item, const Factory::FactoryConfiguration& conf) const
 {
-	const auto& toposort = facility_toposort[item];
-	const auto& toposort_inv = facility_toposort_inv[item];
-	const auto& edge_table = edge_table_per_item[item];
+	return build_flowgraph(item, facility_toposort[item], facility_toposort_inv[item], edge_table_per_item[item], conf);
+}
+
+FlowGraph Factory::build_flowgraph(item_t item, size_t component, const Factory::FactoryConfiguration& conf) const
+{
+	const auto& comp = components_per_item[item][component];
+	return build_flowgraph(item, comp.facilities, component_facility_inv[item], comp.transport_lines, conf);
+}
 
+// builds the flowgraph for `item` out of the facilities in `toposort` and the
+// transport lines in `edge_table`. toposort_inv maps facility indices back to
+// their position in `toposort`.
+FlowGraph Factory::build_flowgraph(item_t item, const vector<size_t>& toposort,
+	const vector<size_t>& toposort_inv, const vector<size_t>& edge_table,
+	const Factory::FactoryConfiguration& conf) const
+{
 	FlowGraph flowgraph;
 	flowgraph.edges.reserve(edge_table.size());
 	flowgraph.nodes.reserve(toposort.size());
@@ -168,16 +379,7 @@ FlowGraph Factory::build_flowgraph(item_t item, const Factory::FactoryConfigurat
 	// topologically sorted from producers to consumers.
 	for (size_t facility_index : toposort)
 	{
-		const auto& facility = facilities[facility_index];
-		size_t level = conf.facility_levels[facility_index];
-		int production_rate;
-		auto iter = facility.upgrade_plan[level].production_or_consumption.find(item);
-		if (iter != facility.upgrade_plan[level].production_or_consumption.end())
-			production_rate = iter->second;
-		else
-			production_rate = 0;
-
-		flowgraph.nodes.emplace_back(production_rate);
+		flowgraph.nodes.emplace_back(production_rate(facility_index, conf.facility_levels[facility_index], item));
 	}
 
 	// insert all transport lines that are relevant for `item`
@@ -186,9 +388,7 @@ FlowGraph Factory::build_flowgraph(item_t item, const Factory::FactoryConfigurat
 		const auto& edge = transport_lines[edge_table[edge_index]];
 		assert(edge.item_type == item);
 		size_t level = conf.transport_levels[edge_table[edge_index]];
-		int capacity = edge.upgrade_plan[level].capacity;
-	
-		flowgraph.edges.emplace_back(capacity);
+		flowgraph.edges.emplace_back(edge.capacity(level));
 	}
 
 	// fill the nodes' edgetables.
@@ -206,47 +406,215 @@ FlowGraph Factory::build_flowgraph(item_t item, const Factory::FactoryConfigurat
 	return flowgraph;
 }
 
-void Factory::simulate_debug(const FactoryConfiguration& conf) const
+BatchFlowGraph Factory::build_batch_flowgraph(item_t item, size_t component, const vector<FactoryConfiguration>& confs) const
 {
-	FlowGraph flowgraphs[MAX_ITEM];
-	for (int i = 0; i < MAX_ITEM; i++)
+	const auto& comp = components_per_item[item][component];
+	const auto& facility_inv = component_facility_inv[item];
+	const size_t lanes = confs.size();
+
+	BatchFlowGraph batch(comp.facilities.size(), comp.transport_lines.size(), lanes);
+
+	for (size_t i = 0; i < comp.facilities.size(); i++)
+		for (size_t l = 0; l < lanes; l++)
+			batch.max_production[i*lanes + l] = production_rate(comp.facilities[i], confs[l].facility_levels[comp.facilities[i]], item);
+
+	vector<size_t> from, to;
+	for (size_t i = 0; i < comp.transport_lines.size(); i++)
 	{
-		flowgraphs[i] = build_flowgraph(item_t(i), conf);
-		flowgraphs[i].calculate();
+		const auto& edge = transport_lines[comp.transport_lines[i]];
+		assert(edge.item_type == item);
+		for (size_t l = 0; l < lanes; l++)
+			batch.capacity[i*lanes + l] = edge.capacity(confs[l].transport_levels[comp.transport_lines[i]]);
+
+		from.push_back(facility_inv[edge.from]);
+		to.push_back(facility_inv[edge.to]);
 	}
 
-	cout << "digraph \"factory\" {" << endl;
+	batch.build(from, to);
+	return batch;
+}
+
+BatchFlowGraph Factory::build_batch_flowgraph(item_t item, size_t component, const FactoryConfiguration& conf, size_t lanes) const
+{
+	const auto& comp = components_per_item[item][component];
+	const auto& facility_inv = component_facility_inv[item];
+
+	BatchFlowGraph batch(comp.facilities.size(), comp.transport_lines.size(), lanes);
+
+	for (size_t i = 0; i < comp.facilities.size(); i++)
+	{
+		rate_t rate = production_rate(comp.facilities[i], conf.facility_levels[comp.facilities[i]], item);
+		fill_n(batch.max_production.begin() + long(i*lanes), lanes, rate);
+	}
+
+	vector<size_t> from, to;
+	for (size_t i = 0; i < comp.transport_lines.size(); i++)
+	{
+		const auto& edge = transport_lines[comp.transport_lines[i]];
+		assert(edge.item_type == item);
+		fill_n(batch.capacity.begin() + long(i*lanes), lanes, edge.capacity(conf.transport_levels[comp.transport_lines[i]]));
+
+		from.push_back(facility_inv[edge.from]);
+		to.push_back(facility_inv[edge.to]);
+	}
+
+	batch.build(from, to);
+	return batch;
+}
+
+vector<bool> Factory::are_valid(const vector<FactoryConfiguration>& confs) const
+{
+	const size_t LANES = 16; // enough to fill an AVX-512 register with ints
+
+	vector<bool> result(confs.size(), true);
+
+	for (size_t first = 0; first < confs.size(); first += LANES)
+	{
+		vector<FactoryConfiguration> chunk(confs.begin() + first, confs.begin() + min(first + LANES, confs.size()));
+
+		for (int item = 0; item < MAX_ITEM; item++)
+			for (size_t c = 0; c < components_per_item[item].size(); c++)
+			{
+				BatchFlowGraph batch = build_batch_flowgraph(item_t(item), c, chunk);
+				batch.calculate();
+				for (size_t l = 0; l < chunk.size(); l++)
+					if (!batch.is_valid(l))
+						result[first + l] = false;
+			}
+	}
+
+	return result;
+}
+
+double Factory::upgrade_cost(const FactoryConfiguration& from, const FactoryConfiguration& to) const
+{
+	double cost = 0.;
 
 	for (size_t i = 0; i < facilities.size(); i++)
 	{
-		bool unsatisfied = false;
+		if (to.facility_levels[i] < from.facility_levels[i])
+			return -1.;
+		for (size_t level = from.facility_levels[i]+1; level <= to.facility_levels[i]; level++)
+			cost += facilities[i].incremental_cost(level);
+	}
 
-		cout << "\t" << i << " [label=\"";
-		for (item_t item : facilities[i].items)
-		{
-			const auto& node = flowgraphs[item].nodes[facility_toposort_inv[item][i]];
-			// if it's a consumer which is getting not enough input
-			if (node.max_production < 0 && -node.actual_production < -node.max_production)
-				unsatisfied = true;
+	for (size_t i = 0; i < transport_lines.size(); i++)
+	{
+		if (to.transport_levels[i] < from.transport_levels[i])
+			return -1.;
+		for (size_t level = from.transport_levels[i]+1; level <= to.transport_levels[i]; level++)
+			cost += transport_lines[i].incremental_cost(level);
+	}
+
+	return cost;
+}
+
+static uint64_t fingerprint_mix(uint64_t h, uint64_t value)
+{
+	// splitmix64 finalizer over the running hash
+	h ^= value + 0x9e3779b97f4a7c15 + (h << 6) + (h >> 2);
+	h ^= h >> 30; h *= 0xbf58476d1ce4e5b9;
+	h ^= h >> 27; h *= 0x94d049bb133111eb;
+	h ^= h >> 31;
+	return h;
+}
 
-			if (node.max_production != 0)
-				cout << item_name.at(item) << ":" << node.actual_production << "/" << node.max_production << ", ";
+static uint64_t fingerprint_mix(uint64_t h, double value)
+{
+	uint64_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+	return fingerprint_mix(h, bits);
+}
+
+uint64_t Factory::fingerprint() const
+{
+	uint64_t h = fingerprint_mix(uint64_t(0), uint64_t(facilities.size()));
+	for (const Facility& f : facilities)
+	{
+		h = fingerprint_mix(h, uint64_t(f.plan->recipe.size()));
+		for (const auto& entry : f.plan->recipe)
+		{
+			h = fingerprint_mix(h, uint64_t(entry.first));
+			h = fingerprint_mix(h, entry.second);
 		}
-		cout << "\"";
+		h = fingerprint_mix(h, uint64_t(f.levels()));
+		for (double cost : f.plan->incremental_cost)
+			h = fingerprint_mix(h, cost);
+		h = fingerprint_mix(h, f.current);
+		h = fingerprint_mix(h, f.maximum);
+	}
 
-		if (unsatisfied)
-			cout << ", color=red";
+	h = fingerprint_mix(h, uint64_t(transport_lines.size()));
+	for (const TransportLine& line : transport_lines)
+	{
+		h = fingerprint_mix(h, uint64_t(line.item_type));
+		h = fingerprint_mix(h, uint64_t(line.from));
+		h = fingerprint_mix(h, uint64_t(line.to));
+		h = fingerprint_mix(h, line.distance);
+		h = fingerprint_mix(h, uint64_t(line.levels()));
+		for (const TransportLineConfiguration& tier : line.plan->tiers)
+		{
+			h = fingerprint_mix(h, uint64_t(tier.capacity));
+			h = fingerprint_mix(h, tier.incremental_cost);
+		}
+	}
+	return h;
+}
 
-		cout << "];" << endl;
+vector<FlowGraph> Factory::simulate(const FactoryConfiguration& conf) const
+{
+	vector<FlowGraph> flowgraphs(MAX_ITEM);
+	for (int i = 0; i < MAX_ITEM; i++)
+	{
+		flowgraphs[i] = build_flowgraph(item_t(i), conf);
+		flowgraphs[i].calculate();
 	}
+	return flowgraphs;
+}
 
-	cout << endl;
+void Factory::simulate_debug(const FactoryConfiguration& conf) const
+{
+	vector<FlowGraph> flowgraphs = simulate(conf);
 
-	for (size_t i = 0; i < transport_lines.size(); i++)
+	OutputBuffer out(cout);
+	for (const auto& flowgraph : flowgraphs)
+		write_dot(out, flowgraph, "FINAL");
+	write_dot(out, *this, flowgraphs);
+}
+
+vector<FactoryIsland> split_into_islands(const Factory& factory)
+{
+	vector<size_t> parent(factory.facilities.size());
+	for (size_t i = 0; i < parent.size(); i++)
+		parent[i] = i;
+	for (const auto& tl : factory.transport_lines)
+		unite(parent, tl.from, tl.to);
+
+	vector<FactoryIsland> islands;
+	vector<size_t> island_of_root(factory.facilities.size());
+	vector<size_t> new_index(factory.facilities.size());
+
+	for (size_t i = 0; i < factory.facilities.size(); i++)
 	{
-		const auto& tl = transport_lines[i];
-		const auto& edge = flowgraphs[tl.item_type].edges[edge_table_per_item_inv[tl.item_type][i]];
-		cout << "\t" << tl.from << " -> " << tl.to << " [label=\"" << item_name.at(tl.item_type) << ": " << edge.actual_flow << "/" << edge.capacity << "\"];"<<endl;
+		size_t root = find_root(parent, i);
+		if (root == i)
+		{
+			island_of_root[root] = islands.size();
+			islands.emplace_back();
+		}
+		auto& island = islands[island_of_root[root]];
+		new_index[i] = island.factory.facilities.size();
+		island.factory.facilities.push_back(factory.facilities[i]);
+		island.facility_ids.push_back(i);
 	}
-	cout << "}" << endl;
+
+	for (size_t i = 0; i < factory.transport_lines.size(); i++)
+	{
+		const auto& tl = factory.transport_lines[i];
+		auto& island = islands[island_of_root[find_root(parent, tl.from)]];
+		island.factory.transport_lines.emplace_back(tl.item_type, new_index[tl.from], new_index[tl.to], tl.plan, tl.distance);
+		island.transport_line_ids.push_back(i);
+	}
+
+	return islands;
 }
@@ -1,11 +1,13 @@
 #pragma once
 #include <vector>
+#include <cstdint>
 #include <unordered_set>
 #include <set>
 #include <map>
 #include <string>
 
 #include "flowgraph.hpp"
+#include "batchflow.hpp"
 
 enum item_t
 {
@@ -29,68 +31,214 @@ enum item_t
 
 extern std::map<item_t, std::string> item_name;
 
+// a set of items as a bitmask. iterates in ascending order, like std::set.
+struct ItemSet
+{
+	static_assert(MAX_ITEM <= 32, "ItemSet holds at most 32 item types");
+
+	uint32_t bits = 0;
+
+	bool contains(item_t item) const { return (bits >> item) & 1; }
+	void insert(item_t item) { bits |= uint32_t(1) << item; }
+	void erase(item_t item) { bits &= ~(uint32_t(1) << item); }
+	void clear() { bits = 0; }
+	bool empty() const { return bits == 0; }
+	item_t most_advanced() const { return bits ? item_t(31 - __builtin_clz(bits)) : DONE; }
+
+	struct iterator
+	{
+		uint32_t rest;
+		item_t operator*() const { return item_t(__builtin_ctz(rest)); }
+		iterator& operator++() { rest &= rest - 1; return *this; }
+		bool operator!=(const iterator& other) const { return rest != other.rest; }
+	};
+	iterator begin() const { return iterator{bits}; }
+	iterator end() const { return iterator{0}; }
+};
+
+// calls f(i) for every bit i that is set in the mask, in ascending order
+template <typename F> inline void for_each_bit(const std::vector<uint64_t>& mask, F f)
+{
+	for (size_t w = 0; w < mask.size(); w++)
+		for (uint64_t bits = mask[w]; bits; bits &= bits - 1)
+			f(w*64 + size_t(__builtin_ctzll(bits)));
+}
+
 struct Factory
 {
-	struct FacilityConfiguration
+	// upgrade plans are interned and shared: all facilities with the same
+	// recipe refer to the same FacilityPlan, and all transport lines built
+	// from the same belt tiers to the same TransportPlan. the plans are
+	// scaled by each facility's or transport line's own parameters.
+	struct FacilityPlan
 	{
-		std::map<item_t, int> production_or_consumption;
-		double incremental_cost; // cost for upgrading from one level lower to this one.
-		// more data goes here. possibly as a pointer for efficiency
+		// production (positive) or consumption (negative) per unit of throughput
+		std::vector< std::pair<item_t, double> > recipe;
+		std::vector<double> incremental_cost; // [level], cost for upgrading from one level lower to this one.
+
+		bool operator==(const FacilityPlan& other) const { return recipe == other.recipe && incremental_cost == other.incremental_cost; }
 	};
 
 	struct Facility
 	{
-		Facility(std::vector<FacilityConfiguration> upgrade_plan_) :
-			upgrade_plan(std::move(upgrade_plan_))
-		{
-			for (const auto& conf : upgrade_plan)
-				for (const auto& itemprod : conf.production_or_consumption)
-					if (itemprod.second != 0)
-						items.insert(itemprod.first);
-		}
-
-		std::vector<FacilityConfiguration> upgrade_plan;
+		// the throughput goes from `current` at level 0 towards `maximum`, in
+		// equal steps.
+		Facility(const FacilityPlan* plan_, double current_, double maximum_) :
+			plan(plan_), current(current_), maximum(maximum_), items(plan_items()) {}
+
+		const FacilityPlan* plan;
+		double current, maximum;
 		item_t most_advanced_item_involved;
-		std::set<item_t> items; // this facility is relevant for these items.
+		ItemSet items;          // this facility is relevant for these items.
 		                        // either because it produces/consumes them, or
 		                        // because it has edges of that type.
+
+		size_t levels() const { return plan->incremental_cost.size(); }
+		double incremental_cost(size_t level) const { return plan->incremental_cost[level]; }
+		rate_t production(size_t level, item_t item) const; // negative for consumption
+		ItemSet plan_items() const; // the items produced or consumed on any level
 	};
 
 	struct TransportLineConfiguration
 	{
-		int capacity;
-		double incremental_cost;
+		rate_t capacity;
+		double incremental_cost; // per unit of distance
 		// more data goes here.
 	};
 
+	struct TransportPlan
+	{
+		std::vector<TransportLineConfiguration> tiers;
+
+		bool operator==(const TransportPlan& other) const;
+	};
+
 	struct TransportLine
 	{
-		TransportLine(item_t it, size_t from_, size_t to_, std::vector<TransportLineConfiguration> upgrade_plan_) :
-			item_type(it), from(from_), to(to_), upgrade_plan(std::move(upgrade_plan_)) {}
+		TransportLine(item_t it, size_t from_, size_t to_, const TransportPlan* plan_, double distance_) :
+			item_type(it), from(from_), to(to_), plan(plan_), distance(distance_) {}
 
 		item_t item_type;
 		size_t from; // index in facilities[]
 		size_t to;   // index in facilities[]
 
-		std::vector<TransportLineConfiguration> upgrade_plan;
+		const TransportPlan* plan;
+		double distance;
+
+		size_t levels() const { return plan->tiers.size(); }
+		rate_t capacity(size_t level) const { return plan->tiers[level].capacity; }
+		double incremental_cost(size_t level) const { return plan->tiers[level].incremental_cost * distance; }
 	};
 
+	// returns the shared copy of plan. the result stays valid for the whole
+	// lifetime of the program. thread safe.
+	static const FacilityPlan* intern(FacilityPlan plan);
+	static const TransportPlan* intern(TransportPlan plan);
+
 	struct FactoryConfiguration
 	{
 		std::vector<size_t> facility_levels;
 		std::vector<size_t> transport_levels;
 	};
 
+	// a weakly connected part of a single item's flowgraph. different
+	// components of the same item can be simulated and upgraded independently.
+	struct Component
+	{
+		std::vector<size_t> facilities; // indices in facilities[], topologically sorted
+		std::vector<size_t> transport_lines; // indices in transport_lines[]
+	};
+
 	std::vector<Facility> facilities;
 	std::vector<TransportLine> transport_lines;
 
 	// useful methods
 
-	void initialize(); // must be called after filling in the data to initialize dependent data!
+	// must be called after filling in the data to initialize dependent data!
+	// works on all items in parallel, on up to n_threads threads (0 = one per core).
+	void initialize(size_t n_threads = 0);
+
+	// incremental edits of an initialized factory. these keep all dependent
+	// data up to date, so that initialize() needn't be called again.
+	// removing a facility or transport line moves the last one into its
+	// index. add_transport_line() throws if the line would create a cycle,
+	// leaving the factory unchanged.
+	size_t add_facility(Facility facility);
+	size_t add_transport_line(TransportLine line);
+	void remove_facility(size_t index); // also removes all its transport lines
+	void remove_transport_line(size_t index);
 
 	FlowGraph build_flowgraph(item_t item, const Factory::FactoryConfiguration& conf) const;
+	FlowGraph build_flowgraph(item_t item, size_t component, const Factory::FactoryConfiguration& conf) const;
+	std::vector<FlowGraph> simulate(const FactoryConfiguration& conf) const; // result[item] is the item's calculated flowgraph
 	void simulate_debug(const FactoryConfiguration& conf) const; // calculates the flow and outputs a graphviz-dot-graph.
 
+	// total incremental cost of upgrading `from` to `to`, or a negative
+	// value if `to` can't be reached from `from` by upgrades only.
+	double upgrade_cost(const FactoryConfiguration& from, const FactoryConfiguration& to) const;
+
+	// a hash of everything a search result depends on: the facilities' recipes,
+	// levels and throughputs, and the transport lines' items, ends, tiers and
+	// distances. equal across runs and builds for the same factory.
+	uint64_t fingerprint() const;
+
+	// lane l of the result simulates confs[l]. nodes and edges are ordered like
+	// in build_flowgraph(item, component, ...).
+	BatchFlowGraph build_batch_flowgraph(item_t item, size_t component, const std::vector<FactoryConfiguration>& confs) const;
+	// result[i] tells whether confs[i] satisfies all demands. simulates many
+	// configurations at once, which is much faster than one at a time.
+	std::vector<bool> are_valid(const std::vector<FactoryConfiguration>& confs) const;
+
+	// what upgrading a single facility or transport line by one level would
+	// change about conf: the total consumption that gets satisfied, summed
+	// over all items, per cost of the upgrade.
+	struct UpgradeGain
+	{
+		bool is_transport_line;
+		size_t index; // in facilities[] or transport_lines[]
+		double cost; // incremental cost of the next level
+		rate_t gain; // change of the satisfied consumption, may be negative
+		double gain_per_cost; // infinite if the upgrade is free and gains anything
+	};
+	// for every facility and transport line that can still be upgraded, best
+	// gain per cost first. each component is simulated once as it is, and
+	// once for all its upgrade candidates together, in a BatchFlowGraph.
+	std::vector<UpgradeGain> upgrade_gains(const FactoryConfiguration& conf) const;
+
+	// simulate() looks at every item on its own, so a facility that is
+	// starved of one input still consumes all of the others, and one that
+	// can't ship its output still consumes its inputs. simulate_coupled()
+	// enforces the recipe ratios instead: every facility runs at a
+	// utilization (a fraction of its throughput at its level) that none of
+	// its inputs and shipped outputs limits further. it solves all items,
+	// in parallel, over and over, each time limiting every facility's demand
+	// of each item to what the facility's other items allowed for last time,
+	// until these limits change by less than `threshold`. facilities which
+	// compete for the same items could take turns starving each other
+	// forever, so limits that went up and down a few times may only go down
+	// afterwards. the final flows respect every facility's utilization.
+	struct CoupledOptions
+	{
+		double threshold = 1e-3;
+		size_t max_iterations = 100;
+		size_t n_threads = 0; // 0 = one per core
+	};
+	struct CoupledResult
+	{
+		// like simulate()'s, with all facilities running at their utilization.
+		// max_production is still the rate at full utilization.
+		std::vector<FlowGraph> flowgraphs;
+		std::vector<double> utilization; // [index_in_facilities], 1 for facilities without rates
+		// [index_in_facilities], true if an input limits the utilization. a
+		// facility below 1 that isn't starved is limited by the demand for
+		// its outputs instead.
+		std::vector<bool> starved;
+		size_t iterations;
+		bool converged; // false if max_iterations was reached first
+	};
+	CoupledResult simulate_coupled(const FactoryConfiguration& conf, const CoupledOptions& options) const;
+	CoupledResult simulate_coupled(const FactoryConfiguration& conf) const { return simulate_coupled(conf, CoupledOptions()); }
+
 
 	// dependent / redundant data follows
 
@@ -103,9 +251,74 @@ struct Factory
 	std::vector< std::vector<size_t> > edge_table_per_item;
 	std::vector< std::vector<size_t> > edge_table_per_item_inv;
 
+	// item_revision[item_level] changes whenever the item's flowgraph changes
+	// (by initialize() or by edits), so results computed for a certain
+	// revision of a flowgraph can be reused as long as it stays the same.
+	std::vector<size_t> item_revision;
+
+	// relevant_facilities_mask(item_level) has bit i set if facilities[i] is
+	// still relevant when considering item_level or any less advanced item,
+	// i.e. if its most_advanced_item_involved <= item_level. same for
+	// transport lines and their item_type. item_level may be DONE.
+	const std::vector<uint64_t>& relevant_facilities_mask(item_t item) const { return facility_relevance[size_t(item+1)]; }
+	const std::vector<uint64_t>& relevant_transport_lines_mask(item_t item) const { return transport_relevance[size_t(item+1)]; }
+
+	// facility_outgoing[index_in_facilities] = indices in transport_lines[] starting there
+	std::vector< std::vector<size_t> > facility_outgoing;
+	std::vector< std::vector<size_t> > facility_incoming;
+
+	// components_per_item[item_level][c] = c-th weakly connected component of
+	// the item's flowgraph. after initialize(), they're ordered by their first
+	// facility in facility_toposort. edits don't keep that order.
+	std::vector< std::vector<Component> > components_per_item;
+	// component_of_facility[item_level][index_in_facilities] = index in components_per_item[item_level]
+	std::vector< std::vector<size_t> > component_of_facility;
+	// component_facility_inv[item_level][index_in_facilities] = index in Component::facilities
+	std::vector< std::vector<size_t> > component_facility_inv;
+	// component_edge_inv[item_level][index_in_edges] = index in Component::transport_lines
+	std::vector< std::vector<size_t> > component_edge_inv;
+
 	private:
-		std::vector<size_t> collect_relevant_facilities(item_t item) const;
-		void build_topological_sort();
+		void build_topological_sort(size_t n_threads);
 		void build_edge_table();
 		void build_facility_itemset();
+		void build_components(size_t n_threads);
+		void build_relevance_masks();
+		rate_t production_rate(size_t facility_index, size_t level, item_t item) const;
+		// all lanes simulate conf
+		BatchFlowGraph build_batch_flowgraph(item_t item, size_t component, const FactoryConfiguration& conf, size_t lanes) const;
+
+		// [item_level+1][word], see relevant_facilities_mask()
+		std::vector< std::vector<uint64_t> > facility_relevance;
+		std::vector< std::vector<uint64_t> > transport_relevance;
+		void resize_relevance_masks();
+		void update_relevance(std::vector< std::vector<uint64_t> >& masks, size_t index, item_t first_relevant_item);
+
+		size_t revision_counter = 0;
+		void touch(item_t item) { item_revision[item] = ++revision_counter; }
+
+		// helpers for the incremental edits
+		bool is_relevant(size_t facility_index, item_t item) const;
+		void update_most_advanced_item(size_t facility_index);
+		void make_relevant(size_t facility_index, item_t item);
+		void make_irrelevant_if_unused(size_t facility_index, item_t item);
+		void remove_from_item(size_t facility_index, item_t item);
+		void remove_component(item_t item, size_t component);
+		void sort_component(item_t item, size_t component);
+		void split_component_if_disconnected(item_t item, size_t component);
+		void reorder_for_new_edge(item_t item, size_t from, size_t to);
+		FlowGraph build_flowgraph(item_t item, const std::vector<size_t>& facility_list,
+			const std::vector<size_t>& facility_inv, const std::vector<size_t>& edge_list,
+			const Factory::FactoryConfiguration& conf) const;
 };
+
+// a part of a factory that shares no facilities and no transport lines with
+// the rest. islands can be optimized independently of each other.
+struct FactoryIsland
+{
+	Factory factory; // not yet initialized
+	std::vector<size_t> facility_ids; // facility_ids[i] = index of factory.facilities[i] in the original factory
+	std::vector<size_t> transport_line_ids; // same for transport lines
+};
+
+std::vector<FactoryIsland> split_into_islands(const Factory& factory);
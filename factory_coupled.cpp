@@ -0,0 +1,143 @@
+#include "factory.hpp"
+#include "parallel.hpp"
+
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <cmath>
+
+using namespace std;
+
+Factory::CoupledResult Factory::simulate_coupled(const FactoryConfiguration& conf, const CoupledOptions& options) const
+{
+	// spawning threads for every round only pays off for large factories
+	size_t n_nodes = 0;
+	for (const auto& toposort : facility_toposort)
+		n_nodes += toposort.size();
+	size_t n_threads = options.n_threads ? options.n_threads : max(1u, thread::hardware_concurrency());
+	n_threads = min<size_t>(n_threads, MAX_ITEM);
+	if (n_nodes < 10000)
+		n_threads = 1;
+
+	// per item and flowgraph node: the fraction of the nominal rate the node
+	// may produce or consume, and the fraction it achieved with that. a node
+	// which got all it asked for is limited by something else, so it has
+	// achieved 1.
+	vector< vector<double> > limit(MAX_ITEM), achieved(MAX_ITEM);
+	// per item and node, how the limit changed last time, and how often it
+	// changed its direction. competing facilities can take turns starving
+	// each other forever; after a few turns, their limits may only decrease.
+	const size_t MAX_REVERSALS = 4;
+	vector< vector<double> > last_step(MAX_ITEM);
+	vector< vector<size_t> > reversals(MAX_ITEM);
+	for (int item = 0; item < MAX_ITEM; item++)
+	{
+		limit[item].assign(facility_toposort[item].size(), 1.);
+		achieved[item].assign(facility_toposort[item].size(), 1.);
+		last_step[item].assign(facility_toposort[item].size(), 0.);
+		reversals[item].assign(facility_toposort[item].size(), 0);
+	}
+
+	CoupledResult result;
+	result.flowgraphs.resize(MAX_ITEM);
+
+	auto solve = [&](size_t item_, size_t)
+	{
+		const item_t item = item_t(item_);
+		FlowGraph& flowgraph = result.flowgraphs[item];
+		flowgraph = build_flowgraph(item, conf);
+		for (size_t i = 0; i < flowgraph.nodes.size(); i++)
+			flowgraph.nodes[i].max_production = rate_t(flowgraph.nodes[i].max_production * limit[item][i]);
+		flowgraph.calculate();
+
+		for (size_t i = 0; i < flowgraph.nodes.size(); i++)
+		{
+			const auto& node = flowgraph.nodes[i];
+			size_t f = facility_toposort[item][i];
+			rate_t nominal = production_rate(f, conf.facility_levels[f], item);
+
+			// outputs that aren't shipped anywhere are stored on site and never
+			// block. the fair splitter's rounding loses a few units here and
+			// there, which mustn't count as being starved.
+			bool limits = node.max_production < 0 || !node.outgoing_edges.empty();
+			double tolerance = options.threshold * abs(nominal);
+			if (nominal != 0 && limits && abs(node.actual_production) < abs(node.max_production) - tolerance)
+				achieved[item][i] = double(node.actual_production) / nominal;
+			else
+				achieved[item][i] = 1.;
+		}
+	};
+
+	// what a facility's items allow, all of them or all but one
+	auto allowed = [&](size_t f, item_t except)
+	{
+		double result = 1.;
+		for (item_t item : facilities[f].items)
+			if (item != except && production_rate(f, conf.facility_levels[f], item) != 0)
+				result = min(result, achieved[item][facility_toposort_inv[item][f]]);
+		return result;
+	};
+
+	result.converged = false;
+	for (result.iterations = 1; result.iterations <= options.max_iterations; result.iterations++)
+	{
+		parallel_for(MAX_ITEM, n_threads, solve);
+
+		// an item that is a facility's bottleneck asks for all it can get.
+		// limiting it to what the facility's other bottlenecks allowed makes
+		// facilities with two equally starved inputs flip back and forth.
+		double change = 0.;
+		for (size_t f = 0; f < facilities.size(); f++)
+			for (item_t item : facilities[f].items)
+			{
+				size_t i = facility_toposort_inv[item][f];
+				double new_limit = allowed(f, item);
+				if (achieved[item][i] <= new_limit)
+					new_limit = 1.;
+
+				double step = new_limit - limit[item][i];
+				if (step * last_step[item][i] < 0.)
+					reversals[item][i]++;
+				if (step != 0.)
+					last_step[item][i] = step;
+				if (reversals[item][i] >= MAX_REVERSALS)
+					new_limit = min(new_limit, limit[item][i]);
+
+				change = max(change, fabs(new_limit - limit[item][i]));
+				limit[item][i] = new_limit;
+			}
+
+		if (change < options.threshold)
+		{
+			result.converged = true;
+			break;
+		}
+	}
+	result.iterations = min(result.iterations, options.max_iterations);
+
+	// finally, every facility runs all of its items at the same utilization
+	result.utilization.resize(facilities.size());
+	result.starved.assign(facilities.size(), false);
+	for (size_t f = 0; f < facilities.size(); f++)
+	{
+		result.utilization[f] = allowed(f, DONE);
+		if (result.utilization[f] < 1.)
+			for (item_t item : facilities[f].items)
+				if (production_rate(f, conf.facility_levels[f], item) < 0
+					&& achieved[item][facility_toposort_inv[item][f]] <= result.utilization[f])
+					result.starved[f] = true;
+		for (item_t item : facilities[f].items)
+			limit[item][facility_toposort_inv[item][f]] = result.utilization[f];
+	}
+	parallel_for(MAX_ITEM, n_threads, solve);
+
+	// show what the facilities could do at full utilization, like simulate()
+	for (int item = 0; item < MAX_ITEM; item++)
+		for (size_t i = 0; i < result.flowgraphs[item].nodes.size(); i++)
+		{
+			size_t f = facility_toposort[item][i];
+			result.flowgraphs[item].nodes[i].max_production = production_rate(f, conf.facility_levels[f], item_t(item));
+		}
+
+	return result;
+}
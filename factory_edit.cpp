@@ -0,0 +1,460 @@
+#include "factory.hpp"
+
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <unordered_set>
+#include <stdexcept>
+#include <cassert>
+
+using namespace std;
+
+// incremental edits of an initialized factory.
+//
+// every item's facility_toposort is maintained with the Pearce-Kelly dynamic
+// topological order algorithm: inserting an edge only reorders the facilities
+// between its endpoints which are actually affected, and finds cycles before
+// anything is changed. components are merged when an edge connects them and
+// are split (if neccessary) when an edge is removed; this only touches the
+// affected component.
+
+bool Factory::is_relevant(size_t facility_index, item_t item) const
+{
+	return facilities[facility_index].items.contains(item);
+}
+
+void Factory::update_most_advanced_item(size_t facility_index)
+{
+	Facility& facility = facilities[facility_index];
+	facility.most_advanced_item_involved = facility.items.most_advanced();
+	update_relevance(facility_relevance, facility_index, facility.most_advanced_item_involved);
+}
+
+// adds a facility without any `item`-edges to the item's flowgraph
+void Factory::make_relevant(size_t facility_index, item_t item)
+{
+	touch(item);
+	facilities[facility_index].items.insert(item);
+	update_most_advanced_item(facility_index);
+
+	facility_toposort[item].push_back(facility_index);
+	facility_toposort_inv[item][facility_index] = facility_toposort[item].size()-1;
+
+	component_of_facility[item][facility_index] = components_per_item[item].size();
+	component_facility_inv[item][facility_index] = 0;
+	components_per_item[item].emplace_back();
+	components_per_item[item].back().facilities.push_back(facility_index);
+}
+
+// removes a facility, which must not have any `item`-edges left, from the item's flowgraph
+void Factory::remove_from_item(size_t facility_index, item_t item)
+{
+	touch(item);
+	auto& toposort = facility_toposort[item];
+	auto& toposort_inv = facility_toposort_inv[item];
+	size_t pos = toposort_inv[facility_index];
+	toposort.erase(toposort.begin() + long(pos));
+	for (size_t i = pos; i < toposort.size(); i++)
+		toposort_inv[toposort[i]] = i;
+
+	size_t c = component_of_facility[item][facility_index];
+	assert(components_per_item[item][c].facilities.size() == 1);
+	assert(components_per_item[item][c].transport_lines.empty());
+	remove_component(item, c);
+
+	facilities[facility_index].items.erase(item);
+	update_most_advanced_item(facility_index);
+}
+
+// a facility stays relevant for `item` as long as it produces or consumes it,
+// or has `item`-edges.
+void Factory::make_irrelevant_if_unused(size_t facility_index, item_t item)
+{
+	if (!is_relevant(facility_index, item))
+		return;
+
+	for (size_t edge_id : facility_outgoing[facility_index])
+		if (transport_lines[edge_id].item_type == item)
+			return;
+	for (size_t edge_id : facility_incoming[facility_index])
+		if (transport_lines[edge_id].item_type == item)
+			return;
+	for (size_t level = 0; level < facilities[facility_index].levels(); level++)
+		if (production_rate(facility_index, level, item) != 0)
+			return;
+
+	remove_from_item(facility_index, item);
+}
+
+// removes an empty component. the last component takes its index.
+void Factory::remove_component(item_t item, size_t component)
+{
+	auto& components = components_per_item[item];
+	if (component != components.size()-1)
+	{
+		components[component] = move(components.back());
+		for (size_t facility_index : components[component].facilities)
+			component_of_facility[item][facility_index] = component;
+	}
+	components.pop_back();
+}
+
+// restores the topological order of a component's facility list
+void Factory::sort_component(item_t item, size_t component)
+{
+	auto& list = components_per_item[item][component].facilities;
+	const auto& toposort_inv = facility_toposort_inv[item];
+	sort(list.begin(), list.end(), [&](size_t a, size_t b) { return toposort_inv[a] < toposort_inv[b]; });
+	for (size_t i = 0; i < list.size(); i++)
+		component_facility_inv[item][list[i]] = i;
+}
+
+// after an edge has been removed, the component might fall apart into two.
+void Factory::split_component_if_disconnected(item_t item, size_t component)
+{
+	const auto& facility_list = components_per_item[item][component].facilities;
+
+	// flood-fill from the first facility
+	vector<size_t> stack(1, facility_list[0]);
+	unordered_set<size_t> reached = {facility_list[0]};
+	while (!stack.empty())
+	{
+		size_t f = stack.back();
+		stack.pop_back();
+
+		for (const auto* adjacency : {&facility_outgoing[f], &facility_incoming[f]})
+			for (size_t edge_id : *adjacency)
+			{
+				const auto& edge = transport_lines[edge_id];
+				if (edge.item_type != item)
+					continue;
+				size_t other = (edge.from == f) ? edge.to : edge.from;
+				if (reached.insert(other).second)
+					stack.push_back(other);
+			}
+	}
+
+	if (reached.size() == facility_list.size())
+		return;
+
+	// move everything we didn't reach into a new component. filtering
+	// keeps both facility lists topologically sorted.
+	Component old_component = move(components_per_item[item][component]);
+	Component reached_part, rest;
+	for (size_t f : old_component.facilities)
+		(reached.count(f) ? reached_part : rest).facilities.push_back(f);
+	for (size_t edge_id : old_component.transport_lines)
+		(reached.count(transport_lines[edge_id].from) ? reached_part : rest).transport_lines.push_back(edge_id);
+
+	components_per_item[item][component] = move(reached_part);
+	components_per_item[item].push_back(move(rest));
+
+	for (size_t c : {component, components_per_item[item].size()-1})
+	{
+		const auto& comp = components_per_item[item][c];
+		for (size_t i = 0; i < comp.facilities.size(); i++)
+		{
+			component_of_facility[item][comp.facilities[i]] = c;
+			component_facility_inv[item][comp.facilities[i]] = i;
+		}
+		for (size_t i = 0; i < comp.transport_lines.size(); i++)
+			component_edge_inv[item][comp.transport_lines[i]] = i;
+	}
+}
+
+// Pearce-Kelly: before inserting the edge from->to, move the facilities
+// reachable from `to` behind the ones reaching `from`, touching only the
+// part of the order between the two. throws if the edge would close a cycle.
+void Factory::reorder_for_new_edge(item_t item, size_t from, size_t to)
+{
+	auto& toposort = facility_toposort[item];
+	auto& toposort_inv = facility_toposort_inv[item];
+	size_t upper = toposort_inv[from];
+	size_t lower = toposort_inv[to];
+	if (lower > upper)
+		return; // the order is fine already
+
+	// forward search from `to`, within the affected region
+	vector<size_t> forward;
+	vector<size_t> stack(1, to);
+	unordered_set<size_t> visited = {to};
+	while (!stack.empty())
+	{
+		size_t f = stack.back();
+		stack.pop_back();
+		forward.push_back(f);
+
+		for (size_t edge_id : facility_outgoing[f])
+		{
+			const auto& edge = transport_lines[edge_id];
+			if (edge.item_type != item)
+				continue;
+			if (edge.to == from)
+				throw runtime_error("transport line would create a cycle for item " + to_string(item));
+			if (toposort_inv[edge.to] < upper && visited.insert(edge.to).second)
+				stack.push_back(edge.to);
+		}
+	}
+
+	// backward search from `from`, within the affected region
+	vector<size_t> backward;
+	stack.assign(1, from);
+	visited.insert(from);
+	while (!stack.empty())
+	{
+		size_t f = stack.back();
+		stack.pop_back();
+		backward.push_back(f);
+
+		for (size_t edge_id : facility_incoming[f])
+		{
+			const auto& edge = transport_lines[edge_id];
+			if (edge.item_type != item)
+				continue;
+			if (toposort_inv[edge.from] > lower && visited.insert(edge.from).second)
+				stack.push_back(edge.from);
+		}
+	}
+
+	// reuse the positions of both sets: first everything reaching `from`,
+	// then everything reachable from `to`, each in their old relative order.
+	auto by_order = [&](size_t a, size_t b) { return toposort_inv[a] < toposort_inv[b]; };
+	sort(backward.begin(), backward.end(), by_order);
+	sort(forward.begin(), forward.end(), by_order);
+
+	vector<size_t> positions;
+	for (size_t f : backward)
+		positions.push_back(toposort_inv[f]);
+	for (size_t f : forward)
+		positions.push_back(toposort_inv[f]);
+	sort(positions.begin(), positions.end());
+
+	size_t i = 0;
+	for (const auto* part : {&backward, &forward})
+		for (size_t f : *part)
+		{
+			toposort[positions[i]] = f;
+			toposort_inv[f] = positions[i];
+			i++;
+		}
+}
+
+size_t Factory::add_facility(Facility facility)
+{
+	size_t index = facilities.size();
+	facilities.push_back(move(facility));
+	resize_relevance_masks();
+	update_most_advanced_item(index);
+	facility_outgoing.emplace_back();
+	facility_incoming.emplace_back();
+
+	for (size_t item = 0; item < MAX_ITEM; item++)
+	{
+		facility_toposort_inv[item].push_back(0);
+		component_of_facility[item].push_back(0);
+		component_facility_inv[item].push_back(0);
+	}
+
+	// the constructor has filled in the items it produces or consumes
+	ItemSet items;
+	swap(items, facilities[index].items);
+	for (item_t item : items)
+		make_relevant(index, item);
+
+	return index;
+}
+
+size_t Factory::add_transport_line(TransportLine line)
+{
+	const item_t item = line.item_type;
+	const size_t from = line.from;
+	const size_t to = line.to;
+	if (from >= facilities.size() || to >= facilities.size() || item < FIRST_ITEM || item >= MAX_ITEM)
+		throw runtime_error("invalid transport line");
+	if (from == to)
+		throw runtime_error("transport line would create a cycle for item " + to_string(item));
+
+	size_t fan_in = 0;
+	for (size_t edge_id : facility_incoming[to])
+		if (transport_lines[edge_id].item_type == item)
+			fan_in++;
+	if (fan_in >= MAX_FAN_IN)
+		throw runtime_error("facility " + to_string(to) + " has " + to_string(MAX_FAN_IN) + " incoming transport lines for item " + to_string(item) + " already");
+
+	// a cycle needs both facilities to be in the item's graph already, so
+	// the order check throws before we change anything.
+	if (!is_relevant(from, item))
+		make_relevant(from, item);
+	if (!is_relevant(to, item))
+		make_relevant(to, item);
+	reorder_for_new_edge(item, from, to);
+	touch(item);
+
+	size_t index = transport_lines.size();
+	transport_lines.push_back(move(line));
+	resize_relevance_masks();
+	update_relevance(transport_relevance, index, item);
+	facility_outgoing[from].push_back(index);
+	facility_incoming[to].push_back(index);
+
+	for (size_t i = 0; i < MAX_ITEM; i++)
+	{
+		edge_table_per_item_inv[i].push_back(0);
+		component_edge_inv[i].push_back(0);
+	}
+	edge_table_per_item[item].push_back(index);
+	edge_table_per_item_inv[item][index] = edge_table_per_item[item].size()-1;
+
+	// merge the smaller component into the bigger one
+	size_t c_from = component_of_facility[item][from];
+	size_t c_to = component_of_facility[item][to];
+	size_t c = c_from;
+	auto& components = components_per_item[item];
+	if (c_from != c_to)
+	{
+		size_t big = c_from, small = c_to;
+		if (components[big].facilities.size() + components[big].transport_lines.size() <
+			components[small].facilities.size() + components[small].transport_lines.size())
+			swap(big, small);
+
+		for (size_t f : components[small].facilities)
+		{
+			component_of_facility[item][f] = big;
+			components[big].facilities.push_back(f);
+		}
+		for (size_t edge_id : components[small].transport_lines)
+		{
+			component_edge_inv[item][edge_id] = components[big].transport_lines.size();
+			components[big].transport_lines.push_back(edge_id);
+		}
+		components[small].facilities.clear();
+		components[small].transport_lines.clear();
+
+		if (big == components.size()-1)
+			big = small; // remove_component() moves the last component into the freed slot
+		remove_component(item, small);
+		c = big;
+	}
+	// the reordering may have moved facilities within the component
+	sort_component(item, c);
+
+	component_edge_inv[item][index] = components[c].transport_lines.size();
+	components[c].transport_lines.push_back(index);
+
+	return index;
+}
+
+void Factory::remove_transport_line(size_t index)
+{
+	if (index >= transport_lines.size())
+		throw runtime_error("invalid transport line index");
+
+	const item_t item = transport_lines[index].item_type;
+	const size_t from = transport_lines[index].from;
+	const size_t to = transport_lines[index].to;
+	touch(item);
+
+	// remove it from the item's tables
+	auto& edge_table = edge_table_per_item[item];
+	size_t pos = edge_table_per_item_inv[item][index];
+	edge_table[pos] = edge_table.back();
+	edge_table_per_item_inv[item][edge_table[pos]] = pos;
+	edge_table.pop_back();
+
+	size_t c = component_of_facility[item][from];
+	auto& comp_lines = components_per_item[item][c].transport_lines;
+	pos = component_edge_inv[item][index];
+	comp_lines[pos] = comp_lines.back();
+	component_edge_inv[item][comp_lines[pos]] = pos;
+	comp_lines.pop_back();
+
+	facility_outgoing[from].erase(find(facility_outgoing[from].begin(), facility_outgoing[from].end(), index));
+	facility_incoming[to].erase(find(facility_incoming[to].begin(), facility_incoming[to].end(), index));
+
+	// the topological order stays valid. but the component might fall
+	// apart, and the facilities might no longer belong to the item's graph.
+	split_component_if_disconnected(item, c);
+	make_irrelevant_if_unused(from, item);
+	make_irrelevant_if_unused(to, item);
+
+	// move the last transport line into the freed index
+	size_t last = transport_lines.size()-1;
+	if (index != last)
+	{
+		transport_lines[index] = move(transport_lines[last]);
+		const auto& moved = transport_lines[index];
+		const item_t moved_item = moved.item_type;
+		touch(moved_item);
+		update_relevance(transport_relevance, index, moved_item);
+
+		edge_table_per_item[moved_item][edge_table_per_item_inv[moved_item][last]] = index;
+		edge_table_per_item_inv[moved_item][index] = edge_table_per_item_inv[moved_item][last];
+
+		size_t moved_c = component_of_facility[moved_item][moved.from];
+		components_per_item[moved_item][moved_c].transport_lines[component_edge_inv[moved_item][last]] = index;
+		component_edge_inv[moved_item][index] = component_edge_inv[moved_item][last];
+
+		*find(facility_outgoing[moved.from].begin(), facility_outgoing[moved.from].end(), last) = index;
+		*find(facility_incoming[moved.to].begin(), facility_incoming[moved.to].end(), last) = index;
+	}
+
+	transport_lines.pop_back();
+	resize_relevance_masks();
+	for (size_t i = 0; i < MAX_ITEM; i++)
+	{
+		edge_table_per_item_inv[i].pop_back();
+		component_edge_inv[i].pop_back();
+	}
+}
+
+void Factory::remove_facility(size_t index)
+{
+	if (index >= facilities.size())
+		throw runtime_error("invalid facility index");
+
+	while (!facility_outgoing[index].empty())
+		remove_transport_line(facility_outgoing[index].back());
+	while (!facility_incoming[index].empty())
+		remove_transport_line(facility_incoming[index].back());
+
+	ItemSet items = facilities[index].items;
+	for (item_t item : items)
+		remove_from_item(index, item);
+
+	// move the last facility into the freed index
+	size_t last = facilities.size()-1;
+	if (index != last)
+	{
+		facilities[index] = move(facilities[last]);
+		update_relevance(facility_relevance, index, facilities[index].most_advanced_item_involved);
+		for (item_t item : facilities[index].items)
+		{
+			touch(item);
+			facility_toposort[item][facility_toposort_inv[item][last]] = index;
+			facility_toposort_inv[item][index] = facility_toposort_inv[item][last];
+
+			size_t c = component_of_facility[item][last];
+			component_of_facility[item][index] = c;
+			components_per_item[item][c].facilities[component_facility_inv[item][last]] = index;
+			component_facility_inv[item][index] = component_facility_inv[item][last];
+		}
+
+		facility_outgoing[index] = move(facility_outgoing[last]);
+		facility_incoming[index] = move(facility_incoming[last]);
+		for (size_t edge_id : facility_outgoing[index])
+			transport_lines[edge_id].from = index;
+		for (size_t edge_id : facility_incoming[index])
+			transport_lines[edge_id].to = index;
+	}
+
+	facilities.pop_back();
+	resize_relevance_masks();
+	facility_outgoing.pop_back();
+	facility_incoming.pop_back();
+	for (size_t item = 0; item < MAX_ITEM; item++)
+	{
+		facility_toposort_inv[item].pop_back();
+		component_of_facility[item].pop_back();
+		component_facility_inv[item].pop_back();
+	}
+}
@@ -0,0 +1,133 @@
+#include "factory.hpp"
+
+#include <vector>
+#include <algorithm>
+#include <limits>
+
+using namespace std;
+
+// how much the consumers of a flowgraph actually receive
+static rate_t satisfied_consumption(const FlowGraph& flowgraph)
+{
+	rate_t result = 0;
+	for (const auto& node : flowgraph.nodes)
+		if (node.max_production < 0)
+			result -= node.actual_production;
+	return result;
+}
+
+static rate_t satisfied_consumption(const BatchFlowGraph& batch, size_t lane)
+{
+	rate_t result = 0;
+	for (size_t i = 0; i < batch.n_nodes; i++)
+		if (batch.max_production[i*batch.lanes + lane] < 0)
+			result -= batch.actual_production[i*batch.lanes + lane];
+	return result;
+}
+
+// upgrading something only changes the components it belongs to, and the
+// flowgraphs of different items don't influence each other. so the gain of
+// an upgrade is the sum of the changes in the components it belongs to.
+vector<Factory::UpgradeGain> Factory::upgrade_gains(const FactoryConfiguration& conf) const
+{
+	const size_t LANES = 16; // like in are_valid()
+
+	auto can_upgrade_facility = [&](size_t f) { return conf.facility_levels[f]+1 < facilities[f].levels(); };
+	auto can_upgrade_line = [&](size_t t) { return conf.transport_levels[t]+1 < transport_lines[t].levels(); };
+
+	vector<rate_t> facility_gain(facilities.size(), 0);
+	vector<rate_t> transport_gain(transport_lines.size(), 0);
+
+	for (int item_ = 0; item_ < MAX_ITEM; item_++)
+	{
+		const item_t item = item_t(item_);
+		for (size_t c = 0; c < components_per_item[item].size(); c++)
+		{
+			const auto& comp = components_per_item[item][c];
+
+			// the upgrades that make a difference for this component. local
+			// indices into the component's facilities/transport lines.
+			vector<size_t> facility_candidates, transport_candidates;
+			for (size_t i = 0; i < comp.facilities.size(); i++)
+			{
+				size_t f = comp.facilities[i];
+				if (can_upgrade_facility(f) &&
+					production_rate(f, conf.facility_levels[f]+1, item) != production_rate(f, conf.facility_levels[f], item))
+					facility_candidates.push_back(i);
+			}
+			for (size_t i = 0; i < comp.transport_lines.size(); i++)
+				if (can_upgrade_line(comp.transport_lines[i]))
+					transport_candidates.push_back(i);
+
+			size_t n_candidates = facility_candidates.size() + transport_candidates.size();
+			if (n_candidates == 0)
+				continue;
+
+			FlowGraph base = build_flowgraph(item, c, conf);
+			base.calculate();
+			const rate_t base_consumption = satisfied_consumption(base);
+
+			// candidate k is facility_candidates[k], or transport_candidates[k - facility_candidates.size()]
+			for (size_t first = 0; first < n_candidates; first += LANES)
+			{
+				size_t lanes = min(LANES, n_candidates - first);
+				BatchFlowGraph batch = build_batch_flowgraph(item, c, conf, lanes);
+
+				for (size_t l = 0; l < lanes; l++)
+				{
+					size_t k = first + l;
+					if (k < facility_candidates.size())
+					{
+						size_t i = facility_candidates[k];
+						size_t f = comp.facilities[i];
+						batch.max_production[i*lanes + l] = production_rate(f, conf.facility_levels[f]+1, item);
+					}
+					else
+					{
+						size_t i = transport_candidates[k - facility_candidates.size()];
+						size_t t = comp.transport_lines[i];
+						batch.capacity[i*lanes + l] = transport_lines[t].capacity(conf.transport_levels[t]+1);
+					}
+				}
+
+				batch.calculate();
+
+				for (size_t l = 0; l < lanes; l++)
+				{
+					size_t k = first + l;
+					rate_t gain = satisfied_consumption(batch, l) - base_consumption;
+					if (k < facility_candidates.size())
+						facility_gain[comp.facilities[facility_candidates[k]]] += gain;
+					else
+						transport_gain[comp.transport_lines[transport_candidates[k - facility_candidates.size()]]] += gain;
+				}
+			}
+		}
+	}
+
+	vector<UpgradeGain> result;
+	auto add = [&](bool is_transport_line, size_t index, double cost, rate_t gain)
+	{
+		double gain_per_cost;
+		if (cost > 0.)
+			gain_per_cost = gain / cost;
+		else if (gain > 0)
+			gain_per_cost = numeric_limits<double>::infinity();
+		else
+			gain_per_cost = gain < 0 ? -numeric_limits<double>::infinity() : 0.;
+		result.push_back(UpgradeGain{is_transport_line, index, cost, gain, gain_per_cost});
+	};
+	for (size_t f = 0; f < facilities.size(); f++)
+		if (can_upgrade_facility(f))
+			add(false, f, facilities[f].incremental_cost(conf.facility_levels[f]+1), facility_gain[f]);
+	for (size_t t = 0; t < transport_lines.size(); t++)
+		if (can_upgrade_line(t))
+			add(true, t, transport_lines[t].incremental_cost(conf.transport_levels[t]+1), transport_gain[t]);
+
+	stable_sort(result.begin(), result.end(), [](const UpgradeGain& a, const UpgradeGain& b) {
+		if (a.gain_per_cost != b.gain_per_cost)
+			return a.gain_per_cost > b.gain_per_cost;
+		return a.gain > b.gain;
+	});
+	return result;
+}
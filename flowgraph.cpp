@@ -3,25 +3,16 @@
 #include <map>
 #include <cassert>
 
-#include <sstream>
-#include <iomanip>
 #include <iostream>
 
 #include "flowgraph.hpp"
+#include "export.hpp"
 
 using namespace std;
 
-template <typename T>
-std::string str(const T a_value, const int n = 3)
+rate_t FlowGraph::Node::incoming() const
 {
-	std::ostringstream out;
-	out << std::setprecision(n) << a_value;
-	return out.str();
-}
-
-int FlowGraph::Node::incoming() const
-{
-	int result = 0;
+	rate_t result = 0;
 
 	for (Edge* edge : incoming_edges)
 		result += edge->actual_flow;
@@ -29,9 +20,9 @@ int FlowGraph::Node::incoming() const
 	return result;
 }
 
-int FlowGraph::Node::available() const // amount available for pushing out
+rate_t FlowGraph::Node::available() const // amount available for pushing out
 {
-	return max(0, incoming() + actual_production);
+	return max(rate_t(0), incoming() + actual_production);
 }
 
 
@@ -40,24 +31,28 @@ int FlowGraph::Node::available() const // amount available for pushing out
 // updates edge.actual_flow and node.excess (and dependent: node.available(), incoming())
 void FlowGraph::Node::update_forward()
 {
+	rate_t in = incoming();
 	if (max_production > 0)
 		actual_production = max_production;
 	else
-		actual_production = -min(incoming(), -max_production); // never consume more than incoming
+		actual_production = -min(in + supply, -max_production); // never consume more than incoming (and buffered)
+
+	drawn = max(rate_t(0), -actual_production - in);
+	rate_t supply_left = supply - drawn;
 	
-	multimap<int, Edge*> sorted_edges;
+	multimap<rate_t, Edge*> sorted_edges;
 	for (Edge* edge : outgoing_edges)
-		sorted_edges.insert( std::pair<int, Edge*>(edge->actual_capacity, edge) );
+		sorted_edges.insert( std::pair<rate_t, Edge*>(edge->actual_capacity, edge) );
 
 	size_t edges_remaining = sorted_edges.size();
-	int amount_remaining = available();
+	rate_t amount_remaining = available() + supply_left;
 
 	for (auto& it : sorted_edges)
 	{
 		Edge* edge = it.second;
 		auto capacity = it.first;
 
-		int fair_share = amount_remaining / edges_remaining; // beware: integer division!
+		rate_t fair_share = amount_remaining / edges_remaining; // beware: integer division!
 		if (fair_share < capacity)
 			edge->actual_flow = fair_share;
 		else
@@ -70,18 +65,30 @@ void FlowGraph::Node::update_forward()
 		assert(amount_remaining >= 0);
 	}
 
+	absorbed = 0;
 	if (edges_remaining == 0)
 	{
 		excess = amount_remaining;
+
+		// take less from the buffer, then put the rest into it
+		rate_t undrawn = min(excess, supply_left);
+		excess -= undrawn;
+		drawn += supply_left - undrawn;
+		absorbed = min(excess, absorb);
+		excess -= absorbed;
+
 		if (actual_production > 0)
 		{
-			int reduction = min(excess, actual_production);
+			rate_t reduction = min(excess, actual_production);
 			actual_production -= reduction;
 			excess -= reduction;
 		}
 	}
 	else
+	{
 		excess = 0;
+		drawn += supply_left;
+	}
 }
 
 // from sinks to sources, propagate any excess which we could neither handle now push out.
@@ -93,21 +100,21 @@ void FlowGraph::Node::update_backward()
 	if (excess <= 0)
 		return;
 
-	int amount = incoming() - excess;
+	rate_t amount = incoming() - excess;
 
-	multimap<int, Edge*> sorted_edges;
+	multimap<rate_t, Edge*> sorted_edges;
 	for (Edge* edge : incoming_edges)
-		sorted_edges.insert( std::pair<int, Edge*>(edge->actual_flow, edge) );
+		sorted_edges.insert( std::pair<rate_t, Edge*>(edge->actual_flow, edge) );
 
 	size_t edges_remaining = sorted_edges.size();
-	int amount_remaining = amount;
+	rate_t amount_remaining = amount;
 
 	for (auto& it : sorted_edges)
 	{
 		Edge* edge = it.second;
 		auto capacity = it.first;
 
-		int fair_share = amount_remaining / edges_remaining; // beware: integer division
+		rate_t fair_share = amount_remaining / edges_remaining; // beware: integer division
 		if (fair_share < capacity)
 			edge->actual_capacity = fair_share;
 		else
@@ -146,7 +153,6 @@ void FlowGraph::calculate()
 		//dump("it"+to_string(i)+".5");
 		i++;
 	} while(!done);
-	dump("FINAL");
 }
 
 // a graph is valid if all nodes have sufficient input
@@ -162,39 +168,10 @@ bool FlowGraph::is_valid() const
 
 // printing functions
 
-string FlowGraph::Edge::label() const
-{
-	string color;
-	if (actual_flow > actual_capacity)
-		color = "color=red,";
-	string label = "label=\""s + str(actual_flow) + "/"s + str(actual_capacity) + "("s+str(capacity)+")\""s;
-	return color+label;
-}
-
-string FlowGraph::Node::label() const
-{
-	string color;
-	if (incoming() < -max_production)
-		color = "color=red,";
-	else if (excess > 0)
-		color = "color=blue,";
-	string label("label=\""s + str(incoming())+"in, "s + str(actual_production)+"/"s+str(max_production)+"prod\\n"s + str(available()) + "avail, "s +  str(excess)+"exc\""s);
-	return color+label;
-}
-
 void FlowGraph::dump(string name) const
 {
-	cout << "digraph \""<<name<<"\" {" << endl;
-
-	for (size_t i=0; i<nodes.size(); i++)
-		cout << "\t" << i << " [" << nodes[i].label() << "];" << endl;
-
-	cout << endl;
-
-	for (const Edge& edge : edges)
-		cout << "\t" << edge_from(&edge) << " -> " << edge_to(&edge) << " [" << edge.label() << "];" << endl;
-
-	cout << "}" << endl;
+	OutputBuffer out(cout);
+	write_dot(out, *this, name);
 }
 
 size_t FlowGraph::edge_from(const Edge* edge) const
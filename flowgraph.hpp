@@ -2,38 +2,46 @@
 #include <string>
 #include <vector>
 
+#include "rate.hpp"
+
 struct FlowGraph
 {
 	// dependent data structures
 
 	struct Edge
 	{
-		Edge(int cap) : capacity(cap), actual_capacity(cap) {}
-
-		int capacity;
-		int actual_capacity;
-		int actual_flow = 0;
+		Edge(rate_t cap) : capacity(cap), actual_capacity(cap) {}
 
-		std::string label() const;
+		rate_t capacity;
+		rate_t actual_capacity;
+		rate_t actual_flow = 0;
 	};
 
 	struct Node
 	{
-		Node(int max_prod) : max_production(max_prod) {}
-
-		int max_production; // negative production = consumption, zero = splitter
-		int actual_production = 0;
-		int excess = 0;
+		Node(rate_t max_prod) : max_production(max_prod) {}
+
+		rate_t max_production; // negative production = consumption, zero = splitter
+		rate_t actual_production = 0;
+		rate_t excess = 0;
+
+		// a buffer at the node can give up to `supply` (to the node's own
+		// consumption first, then to the outgoing edges) and take up to
+		// `absorb` of what can't be pushed out, instead of throttling the
+		// production and the incoming edges. both are zero without a buffer.
+		// see TimeSimulation. `drawn` and `absorbed` tell what it actually did.
+		rate_t supply = 0;
+		rate_t absorb = 0;
+		rate_t drawn = 0;
+		rate_t absorbed = 0;
 
 		std::vector<Edge*> incoming_edges;
 		std::vector<Edge*> outgoing_edges; // max capacity on outgoing = splitter speed.
 
-		int incoming() const;
-		int available() const; // amount available for pushing out
+		rate_t incoming() const;
+		rate_t available() const; // amount available for pushing out
 		void update_forward();
 		void update_backward();
-
-		std::string label() const;
 	};
 
 
@@ -47,7 +55,7 @@ struct FlowGraph
 
 	void build();
 	void calculate();
-	void dump(std::string name) const;
+	void dump(std::string name) const; // as graphviz dot to stdout, see export.hpp
 	bool is_valid() const;
 	size_t edge_from(const Edge* edge) const;
 	size_t edge_to(const Edge* edge) const;
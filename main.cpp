@@ -1,34 +1,389 @@
 #include <cassert>
 #include <iostream>
+#include <string>
+#include <thread>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <chrono>
 
 #include "factory.hpp"
 #include "flowgraph.hpp"
 #include "actiongraph.hpp"
 #include "read_factory.h"
+#include "server.hpp"
+#include "milp.hpp"
+#include "batchsolve.hpp"
+#include "export.hpp"
+#include "timesim.hpp"
 
 using namespace std;
 
 static const string delimiter = "\n\n=====================================================================\n\n\n";
 
+static void usage(const char* argv0)
+{
+	cout << "Usage: " << argv0 << " factory.tgf [--max-seconds=S] [--max-expansions=N] [--milp] [--milp-bound] [--closed-list=FILE]" << endl;
+	cout << "       " << string(strlen(argv0), ' ') << "             [--checkpoint=FILE [--checkpoint-interval=S]] [--resume=FILE] [--tiers=FILE]" << endl;
+	cout << "       " << string(strlen(argv0), ' ') << "             [--export-dot=FILE] [--export-json=FILE] [--export-binary=FILE] [--coupled]" << endl;
+	cout << "       " << argv0 << " factory.tgf --timeline=S [--buffer=ITEMS] [--tiers=FILE]" << endl;
+	cout << "       " << argv0 << " --crosscheck=N [--facilities=F] [--tiers=FILE]" << endl;
+	cout << "       " << argv0 << " --bench-init[=FACILITIES] [--threads=N]" << endl;
+	cout << "       " << argv0 << " --serve[=socket] [--threads=N] [--tiers=FILE]" << endl;
+	cout << "       " << argv0 << " --batch [--threads=N] [--min-free-memory=MB] [--cache-mb=MB] [--max-seconds=S] [--max-expansions=N]" << endl;
+	cout << "       " << string(strlen(argv0), ' ') << "         [--tiers=FILE] factory.tgf|'pattern*.tgf'..." << endl;
+	exit(1);
+}
+
+static Factory::FactoryConfiguration initial_configuration(const Factory& factory)
+{
+	Factory::FactoryConfiguration conf;
+	conf.facility_levels.assign(factory.facilities.size(), 0);
+	conf.transport_levels.assign(factory.transport_lines.size(), 0);
+	return conf;
+}
+
+// simulates the unupgraded factory for some seconds, starting with empty
+// buffers of the given size at every facility, and prints what happens.
+// facilities are given one-based, like in the .tgf file.
+static int timeline(const Factory& factory, double seconds, double buffer_items)
+{
+	TimeSimulation sim(&factory, initial_configuration(factory),
+		vector<double>(factory.facilities.size(), buffer_items * SCALING_FACTOR));
+	sim.run_until(seconds);
+
+	auto old_flags = cout.flags();
+	cout << fixed << setprecision(3);
+	for (const auto& event : sim.events)
+	{
+		cout << event.time << "s: facility " << event.index+1;
+		switch (event.kind)
+		{
+			case TimeSimulation::Event::BUFFER_FULL: cout << ": buffer of " << item_name.at(event.item) << " full"; break;
+			case TimeSimulation::Event::BUFFER_EMPTY: cout << ": buffer of " << item_name.at(event.item) << " empty"; break;
+			case TimeSimulation::Event::CONSUMER_STARTED: cout << " starts consuming " << item_name.at(event.item); break;
+			case TimeSimulation::Event::CONSUMER_SATISFIED: cout << " gets all the " << item_name.at(event.item) << " it needs"; break;
+			default: cout << " changed its level"; break; // never scheduled from here
+		}
+		cout << endl;
+	}
+	cout.flags(old_flags);
+
+	cout << sim.events.size() << " events, " << sim.recalculations << " flow recalculations" << endl;
+	return 0;
+}
+
+// how long it takes to get a large factory ready, as after starting up.
+// initializes the same generated factory on one thread and on n_threads.
+static int bench_init(size_t n_facilities, size_t n_threads)
+{
+	auto seconds_since = [](chrono::steady_clock::time_point start) {
+		return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	};
+
+	auto start = chrono::steady_clock::now();
+	Factory generated = generate_factory(n_facilities, 0);
+	cout << "generated " << generated.facilities.size() << " facilities and " << generated.transport_lines.size()
+	     << " transport lines in " << seconds_since(start) << "s" << endl;
+
+	Factory serial = generated;
+	start = chrono::steady_clock::now();
+	serial.initialize(1);
+	cout << "initialize on 1 thread: " << seconds_since(start) << "s" << endl;
+
+	Factory parallel = generated;
+	start = chrono::steady_clock::now();
+	parallel.initialize(n_threads);
+	cout << "initialize on " << n_threads << " threads: " << seconds_since(start) << "s" << endl;
+
+	bool same = serial.facility_toposort == parallel.facility_toposort && serial.edge_table_per_item == parallel.edge_table_per_item
+		&& serial.component_of_facility == parallel.component_of_facility;
+	if (!same)
+		cout << "FAIL: the results differ" << endl;
+	return same ? 0 : 1;
+}
+
+// optimizes random factories with both dijkstra and the milp and compares them.
+// any solution dijkstra finds is feasible for the milp, so the milp must never
+// be more expensive. it can be cheaper, though, since dijkstra only upgrades
+// what currently is a bottleneck.
+static int crosscheck(size_t n_instances, size_t n_facilities)
+{
+	size_t failures = 0, agreed = 0, milp_cheaper = 0, inconclusive = 0;
+	for (unsigned seed = 0; seed < n_instances; seed++)
+	{
+		Factory factory = generate_factory(n_facilities, seed);
+		factory.initialize();
+		Factory::FactoryConfiguration conf = initial_configuration(factory);
+
+		ActionGraph graph(&factory);
+		graph.verbose = false;
+		auto search = graph.dijkstra(conf);
+
+		UpgradeOptimizer milp(&factory);
+		auto exact = milp.optimize(conf, 2000);
+
+		string verdict;
+		if (search.second >= 0. && !factory.are_valid({search.first})[0])
+			verdict = "FAIL: dijkstra's solution is invalid";
+		else if (search.second >= 0. && search.second < exact.lower_bound - 1e-6)
+			verdict = "FAIL: dijkstra is below the milp's lower bound";
+		else if (!exact.optimal() && exact.lower_bound < numeric_limits<double>::infinity())
+			verdict = "inconclusive, milp gave up";
+		else if (search.second < 0. && exact.cost < 0.)
+			verdict = "ok, no solution";
+		else if (search.second < 0. || search.second > exact.cost + 1e-6)
+			verdict = "ok, milp is cheaper";
+		else
+			verdict = "ok";
+
+		if (verdict.compare(0, 4, "FAIL") == 0)
+			failures++;
+		else if (verdict == "ok, milp is cheaper")
+			milp_cheaper++;
+		else if (verdict.compare(0, 2, "ok") == 0)
+			agreed++;
+		else
+			inconclusive++;
+
+		cout << "seed " << seed << " (" << factory.facilities.size() << " facilities, " << factory.transport_lines.size() << " transport lines): "
+		     << "dijkstra " << search.second << ", milp " << exact.cost << " (lower bound " << exact.lower_bound << ", "
+		     << exact.nodes << " nodes, " << exact.cuts << " cuts): " << verdict << endl;
+	}
+
+	cout << agreed << " agreed, " << milp_cheaper << " cheaper with the milp, " << inconclusive << " inconclusive, " << failures << " failed" << endl;
+	return failures > 0 ? 1 : 0;
+}
+
 int main(int argc, const char** argv)
 {
-	if (argc != 2)
+	if (argc < 2)
+		usage(argv[0]);
+
+	string first_arg = argv[1];
+	if (first_arg == "--serve" || first_arg.compare(0, 8, "--serve=") == 0)
+	{
+		string socket_path = first_arg.size() > 8 ? first_arg.substr(8) : "";
+		size_t n_threads = max(1u, thread::hardware_concurrency());
+		for (int i = 2; i < argc; i++)
+		{
+			string arg = argv[i];
+			if (arg.compare(0, 10, "--threads=") == 0)
+				n_threads = stoul(arg.substr(10));
+			else if (arg.compare(0, 8, "--tiers=") == 0)
+				load_transport_tiers(arg.substr(8));
+			else
+				usage(argv[0]);
+		}
+		return run_server(socket_path, n_threads);
+	}
+
+	if (first_arg == "--bench-init" || first_arg.compare(0, 13, "--bench-init=") == 0)
+	{
+		size_t n_facilities = first_arg.size() > 13 ? stoul(first_arg.substr(13)) : 720000; // about a million transport lines
+		size_t n_threads = max(1u, thread::hardware_concurrency());
+		for (int i = 2; i < argc; i++)
+		{
+			string arg = argv[i];
+			if (arg.compare(0, 10, "--threads=") == 0)
+				n_threads = stoul(arg.substr(10));
+			else
+				usage(argv[0]);
+		}
+		return bench_init(n_facilities, n_threads);
+	}
+
+	if (first_arg == "--batch")
+	{
+		BatchOptions options;
+		options.n_threads = max(1u, thread::hardware_concurrency());
+		options.min_free_memory = available_memory() / 10;
+		vector<string> patterns;
+		for (int i = 2; i < argc; i++)
+		{
+			string arg = argv[i];
+			if (arg.compare(0, 10, "--threads=") == 0)
+				options.n_threads = stoul(arg.substr(10));
+			else if (arg.compare(0, 18, "--min-free-memory=") == 0)
+				options.min_free_memory = stoul(arg.substr(18)) << 20;
+			else if (arg.compare(0, 11, "--cache-mb=") == 0)
+				options.cache_bytes = stoul(arg.substr(11)) << 20;
+			else if (arg.compare(0, 14, "--max-seconds=") == 0)
+				options.limits.max_seconds = stod(arg.substr(14));
+			else if (arg.compare(0, 17, "--max-expansions=") == 0)
+				options.limits.max_expansions = stoul(arg.substr(17));
+			else if (arg.compare(0, 8, "--tiers=") == 0)
+				load_transport_tiers(arg.substr(8));
+			else if (arg.compare(0, 2, "--") == 0)
+				usage(argv[0]);
+			else
+				patterns.push_back(arg);
+		}
+		if (patterns.empty())
+			usage(argv[0]);
+		return run_batch(patterns, options);
+	}
+
+	string file;
+	ActionGraph::SearchLimits limits;
+	bool anytime = false, use_milp = false, milp_bound = false, coupled = false;
+	string closed_list_file, checkpoint_file, resume_file;
+	string export_dot_file, export_json_file, export_binary_file;
+	double checkpoint_interval = 60.;
+	double timeline_seconds = -1., buffer_items = 10.;
+	size_t crosscheck_instances = 0, crosscheck_facilities = 8;
+	for (int i = 1; i < argc; i++)
 	{
-		cout << "Usage: " << argv[0] << " factory.tgf" << endl;
-		exit(1);
+		string arg = argv[i];
+		if (arg == "--milp")
+			use_milp = true;
+		else if (arg == "--milp-bound")
+			milp_bound = true;
+		else if (arg == "--coupled")
+			coupled = true;
+		else if (arg.compare(0, 8, "--tiers=") == 0)
+			load_transport_tiers(arg.substr(8));
+		else if (arg.compare(0, 13, "--crosscheck=") == 0)
+			crosscheck_instances = stoul(arg.substr(13));
+		else if (arg.compare(0, 13, "--facilities=") == 0)
+			crosscheck_facilities = stoul(arg.substr(13));
+		else if (arg.compare(0, 14, "--closed-list=") == 0)
+			closed_list_file = arg.substr(14);
+		else if (arg.compare(0, 13, "--checkpoint=") == 0)
+			checkpoint_file = arg.substr(13);
+		else if (arg.compare(0, 22, "--checkpoint-interval=") == 0)
+			checkpoint_interval = stod(arg.substr(22));
+		else if (arg.compare(0, 9, "--resume=") == 0)
+			resume_file = arg.substr(9);
+		else if (arg.compare(0, 13, "--export-dot=") == 0)
+			export_dot_file = arg.substr(13);
+		else if (arg.compare(0, 14, "--export-json=") == 0)
+			export_json_file = arg.substr(14);
+		else if (arg.compare(0, 16, "--export-binary=") == 0)
+			export_binary_file = arg.substr(16);
+		else if (arg.compare(0, 11, "--timeline=") == 0)
+			timeline_seconds = stod(arg.substr(11));
+		else if (arg.compare(0, 9, "--buffer=") == 0)
+			buffer_items = stod(arg.substr(9));
+		else if (arg.compare(0, 14, "--max-seconds=") == 0)
+		{
+			limits.max_seconds = stod(arg.substr(14));
+			anytime = true;
+		}
+		else if (arg.compare(0, 17, "--max-expansions=") == 0)
+		{
+			limits.max_expansions = stoul(arg.substr(17));
+			anytime = true;
+		}
+		else if (arg.compare(0, 2, "--") == 0 || !file.empty())
+			usage(argv[0]);
+		else
+			file = arg;
 	}
+	if (crosscheck_instances > 0 && file.empty())
+		return crosscheck(crosscheck_instances, crosscheck_facilities);
+	if (file.empty())
+		usage(argv[0]);
 	
-	Factory factory = read_factory(argv[1]);
+	Factory factory = read_factory(file);
 	factory.initialize();
 
-	Factory::FactoryConfiguration conf;
-	for (size_t i=0; i<factory.facilities.size(); i++)
-		conf.facility_levels.push_back(0);
-	for (size_t i=0; i<factory.transport_lines.size(); i++)
-		conf.transport_levels.push_back(0);
+	if (timeline_seconds >= 0.)
+		return timeline(factory, timeline_seconds, buffer_items);
+
+	Factory::FactoryConfiguration conf = initial_configuration(factory);
+
+	if (milp_bound)
+	{
+		double bound = UpgradeOptimizer(&factory).relaxation_bound(conf);
+		if (bound == numeric_limits<double>::infinity())
+			cout << "no upgrade can satisfy all demands" << endl;
+		else
+			cout << "lower bound = " << bound << endl;
+		return 0;
+	}
 
 	ActionGraph actiongraph(&factory);
-	auto result = actiongraph.dijkstra(conf);
+	actiongraph.closed_list_file = closed_list_file;
+	actiongraph.checkpoint_file = checkpoint_file;
+	actiongraph.checkpoint_interval = checkpoint_interval;
+	pair<Factory::FactoryConfiguration, double> result;
+	if (use_milp)
+	{
+		UpgradeOptimizer milp(&factory);
+		milp.verbose = true;
+		auto found = milp.optimize(conf);
+		if (found.cost < 0.)
+			cout << "could not find a solution :(" << endl;
+		else
+			cout << "success, cost = " << found.cost << (found.optimal() ? " (optimal)" : "") << ", " << found.nodes << " branch and bound nodes" << endl;
+		result = make_pair(found.conf, found.cost);
+	}
+	else if (anytime || !resume_file.empty())
+	{
+		// with a budget, we might have to settle for a solution that is not optimal
+		auto improved = [](const ActionGraph::SearchResult& r) {
+			cout << "improved solution, cost = " << r.cost << " after " << r.expansions << " expansions" << endl;
+		};
+
+		ActionGraph::SearchResult found;
+		if (!resume_file.empty())
+		{
+			SearchCheckpoint checkpoint = SearchCheckpoint::load(resume_file);
+			conf = checkpoint.initial_config;
+			if (anytime)
+				limits.dive_interval = 64;
+			found = actiongraph.resume(checkpoint, limits, improved);
+		}
+		else
+			found = actiongraph.anytime_islands(conf, limits, improved);
+
+		if (found.cost < 0.)
+			cout << "could not find a solution" << (anytime ? " within the budget" : "") << ", lower bound = " << found.lower_bound << endl;
+		else if (found.optimal())
+			cout << "success, cost = " << found.cost << " (optimal), expanded " << found.expansions << " nodes" << endl;
+		else
+			cout << "success, cost = " << found.cost << " (at most " << found.suboptimality() << " times the optimum), expanded " << found.expansions << " nodes" << endl;
+		result = make_pair(found.cost < 0. ? conf : found.conf, found.cost);
+	}
+	else if (!checkpoint_file.empty())
+		result = actiongraph.dijkstra(conf); // a checkpoint holds a single search, see anytime_islands()
+	else
+		result = actiongraph.dijkstra_islands(conf);
+
+	// the after-state, for other tools
+	if (!export_dot_file.empty() || !export_json_file.empty() || !export_binary_file.empty())
+	{
+		Factory::CoupledResult coupled_result;
+		if (coupled)
+			coupled_result = factory.simulate_coupled(result.first);
+		vector<FlowGraph> flowgraphs = coupled ? coupled_result.flowgraphs : factory.simulate(result.first);
+		auto export_to = [](const string& export_file, auto write)
+		{
+			if (export_file.empty())
+				return;
+			ofstream f(export_file, ios::binary);
+			if (!f.good())
+				throw runtime_error("could not create '" + export_file + "'");
+			OutputBuffer out(f);
+			write(out);
+		};
+		export_to(export_dot_file, [&](OutputBuffer& out)
+		{
+			if (coupled)
+				write_dot(out, factory, coupled_result);
+			else
+				write_dot(out, factory, flowgraphs);
+		});
+		export_to(export_json_file, [&](OutputBuffer& out)
+		{
+			if (coupled)
+				write_json(out, factory, result.first, coupled_result);
+			else
+				write_json(out, factory, result.first, flowgraphs);
+		});
+		export_to(export_binary_file, [&](OutputBuffer& out) { write_binary(out, factory, result.first, flowgraphs); });
+	}
 
 	cout << endl << endl << endl << endl;
 	
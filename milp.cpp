@@ -0,0 +1,482 @@
+#include <vector>
+#include <cmath>
+#include <limits>
+#include <iostream>
+#include <stdexcept>
+#include <algorithm>
+
+#include "milp.hpp"
+
+using namespace std;
+
+static constexpr double EPS = 1e-9;
+static constexpr size_t NONE = numeric_limits<size_t>::max();
+
+size_t LinearProgram::add_variable(double cost_, double upper_)
+{
+	cost.push_back(cost_);
+	upper.push_back(upper_);
+	return cost.size()-1;
+}
+
+void LinearProgram::add_constraint(vector< pair<size_t, double> > coefficients, double rhs)
+{
+	constraints.push_back(Constraint{move(coefficients), rhs});
+}
+
+// dense simplex tableau. row `rows` holds the reduced costs and column `cols`
+// holds the right hand sides; the objective's value is -rhs(rows).
+struct SimplexTableau
+{
+	SimplexTableau(size_t rows_, size_t cols_) :
+		rows(rows_), cols(cols_), t((rows_+1)*(cols_+1), 0.), basis(rows_, NONE), barred(cols_, false) {}
+
+	size_t rows, cols;
+	vector<double> t;
+	vector<size_t> basis;
+	vector<bool> barred; // columns that may not enter the basis
+
+	double& at(size_t r, size_t c) { return t[r*(cols+1) + c]; }
+	double& rhs(size_t r) { return at(r, cols); }
+
+	void pivot(size_t r, size_t c);
+	bool run(); // returns false if the objective is unbounded
+};
+
+void SimplexTableau::pivot(size_t r, size_t c)
+{
+	double* pivot_row = &at(r, 0);
+	double p = pivot_row[c];
+	for (size_t k = 0; k <= cols; k++)
+		pivot_row[k] /= p;
+
+	for (size_t i = 0; i <= rows; i++)
+	{
+		if (i == r)
+			continue;
+		double* row = &at(i, 0);
+		double f = row[c];
+		if (f == 0.)
+			continue;
+		for (size_t k = 0; k <= cols; k++)
+			row[k] -= f * pivot_row[k];
+		row[c] = 0.;
+	}
+
+	basis[r] = c;
+}
+
+bool SimplexTableau::run()
+{
+	size_t degenerate_steps = 0;
+	for (size_t iteration = 0; ; iteration++)
+	{
+		if (iteration > 100 * (rows + cols))
+			throw runtime_error("simplex does not converge");
+
+		// dantzig's rule, or bland's rule once we seem to be stalling, which can't cycle
+		bool bland = degenerate_steps > 50;
+		size_t enter = NONE;
+		double most_negative = -EPS;
+		for (size_t c = 0; c < cols; c++)
+		{
+			if (barred[c] || at(rows, c) >= most_negative)
+				continue;
+			enter = c;
+			if (bland)
+				break;
+			most_negative = at(rows, c);
+		}
+		if (enter == NONE)
+			return true;
+
+		size_t leave = NONE;
+		double best_ratio = numeric_limits<double>::infinity();
+		for (size_t r = 0; r < rows; r++)
+		{
+			double a = at(r, enter);
+			if (a <= EPS)
+				continue;
+			double ratio = max(0., rhs(r)) / a;
+			if (ratio < best_ratio - EPS || (ratio <= best_ratio + EPS && leave != NONE && basis[r] < basis[leave]))
+			{
+				best_ratio = min(best_ratio, ratio);
+				leave = r;
+			}
+		}
+		if (leave == NONE)
+			return false;
+
+		degenerate_steps = best_ratio < EPS ? degenerate_steps+1 : 0;
+		pivot(leave, enter);
+	}
+}
+
+LinearProgram::Status LinearProgram::solve(const vector<double>& lower, const vector<double>& upper_,
+	vector<double>& x, double& objective) const
+{
+	size_t n = cost.size();
+
+	// fixed variables are eliminated, all others are shifted by their lower bound
+	vector<size_t> column(n, NONE);
+	vector<size_t> variable;
+	for (size_t j = 0; j < n; j++)
+	{
+		if (upper_[j] < lower[j] - EPS)
+			return INFEASIBLE;
+		if (upper_[j] - lower[j] > EPS)
+		{
+			column[j] = variable.size();
+			variable.push_back(j);
+		}
+	}
+	size_t n_columns = variable.size();
+
+	vector<Constraint> rows;
+	for (const auto& constraint : constraints)
+	{
+		Constraint row{{}, constraint.rhs};
+		for (const auto& coeff : constraint.coefficients)
+		{
+			row.rhs -= coeff.second * lower[coeff.first];
+			if (column[coeff.first] != NONE)
+				row.coefficients.emplace_back(column[coeff.first], coeff.second);
+		}
+
+		if (row.coefficients.empty())
+		{
+			if (row.rhs < -1e-7)
+				return INFEASIBLE;
+			continue;
+		}
+		rows.push_back(move(row));
+	}
+	for (size_t k = 0; k < n_columns; k++)
+		if (upper_[variable[k]] < numeric_limits<double>::infinity())
+			rows.push_back(Constraint{{{k, 1.}}, upper_[variable[k]] - lower[variable[k]]});
+
+	// scale the rows, as rates and capacities are much larger than the binary variables
+	size_t n_artificial = 0;
+	for (auto& row : rows)
+	{
+		double scale = 0.;
+		for (const auto& coeff : row.coefficients)
+			scale = max(scale, fabs(coeff.second));
+		if (scale > 0.)
+		{
+			for (auto& coeff : row.coefficients)
+				coeff.second /= scale;
+			row.rhs /= scale;
+		}
+		if (row.rhs < 0.)
+			n_artificial++;
+	}
+
+	// columns: variables, one slack per row, artificial variables for rows whose rhs is negative
+	size_t m = rows.size();
+	SimplexTableau tab(m, n_columns + m + n_artificial);
+	size_t next_artificial = n_columns + m;
+	for (size_t i = 0; i < m; i++)
+	{
+		double sign = rows[i].rhs < 0. ? -1. : 1.;
+		for (const auto& coeff : rows[i].coefficients)
+			tab.at(i, coeff.first) += sign * coeff.second;
+		tab.at(i, n_columns + i) = sign;
+		tab.rhs(i) = sign * rows[i].rhs;
+
+		if (sign < 0.)
+		{
+			tab.at(i, next_artificial) = 1.;
+			tab.basis[i] = next_artificial++;
+		}
+		else
+			tab.basis[i] = n_columns + i;
+	}
+
+	// phase 1: minimize the sum of the artificial variables
+	if (n_artificial > 0)
+	{
+		for (size_t c = n_columns + m; c < tab.cols; c++)
+			tab.at(m, c) = 1.;
+		for (size_t i = 0; i < m; i++)
+			if (tab.basis[i] >= n_columns + m)
+				for (size_t c = 0; c <= tab.cols; c++)
+					tab.at(m, c) -= tab.at(i, c);
+
+		tab.run();
+		if (-tab.rhs(m) > 1e-7)
+			return INFEASIBLE;
+
+		// pivot the remaining (zero) artificial variables out of the basis. if
+		// that's impossible, the row is redundant and the artificial stays at zero.
+		for (size_t i = 0; i < m; i++)
+			if (tab.basis[i] >= n_columns + m)
+				for (size_t c = 0; c < n_columns + m; c++)
+					if (fabs(tab.at(i, c)) > 1e-7)
+					{
+						tab.pivot(i, c);
+						break;
+					}
+
+		for (size_t c = n_columns + m; c < tab.cols; c++)
+			tab.barred[c] = true;
+	}
+
+	// phase 2: minimize the actual objective
+	for (size_t c = 0; c <= tab.cols; c++)
+		tab.at(m, c) = c < n_columns ? cost[variable[c]] : 0.;
+	for (size_t i = 0; i < m; i++)
+	{
+		if (tab.basis[i] >= n_columns)
+			continue;
+		double cb = cost[variable[tab.basis[i]]];
+		if (cb != 0.)
+			for (size_t c = 0; c <= tab.cols; c++)
+				tab.at(m, c) -= cb * tab.at(i, c);
+	}
+
+	if (!tab.run())
+		return UNBOUNDED;
+
+	x = lower;
+	for (size_t i = 0; i < m; i++)
+		if (tab.basis[i] < n_columns)
+			x[variable[tab.basis[i]]] += tab.rhs(i);
+
+	objective = 0.;
+	for (size_t j = 0; j < n; j++)
+		objective += cost[j] * x[j];
+	return OPTIMAL;
+}
+
+
+UpgradeOptimizer::Model UpgradeOptimizer::build_model(const Factory::FactoryConfiguration& initial_config) const
+{
+	Model model;
+	LinearProgram& lp = model.lp;
+
+	// level variables. y[k] <= y[k-1], so the taken levels are always a prefix
+	auto add_levels = [&](size_t from_level, size_t n_levels, auto incremental_cost, vector<size_t>& vars)
+	{
+		for (size_t level = from_level+1; level < n_levels; level++)
+		{
+			size_t var = lp.add_variable(incremental_cost(level), 1.);
+			if (!vars.empty())
+				lp.add_constraint({{var, 1.}, {vars.back(), -1.}}, 0.);
+			vars.push_back(var);
+			model.integer_vars.push_back(var);
+		}
+	};
+
+	model.facility_level_vars.resize(factory->facilities.size());
+	for (size_t i = 0; i < factory->facilities.size(); i++)
+	{
+		const auto& facility = factory->facilities[i];
+		add_levels(initial_config.facility_levels[i], facility.levels(),
+			[&](size_t level) { return facility.incremental_cost(level); }, model.facility_level_vars[i]);
+	}
+
+	model.transport_level_vars.resize(factory->transport_lines.size());
+	vector<size_t> flow(factory->transport_lines.size());
+	for (size_t i = 0; i < factory->transport_lines.size(); i++)
+	{
+		const auto& line = factory->transport_lines[i];
+		size_t level = initial_config.transport_levels[i];
+		add_levels(level, line.levels(),
+			[&](size_t l) { return line.incremental_cost(l); }, model.transport_level_vars[i]);
+
+		// flow <= capacity
+		flow[i] = lp.add_variable(0.);
+		vector< pair<size_t, double> > coefficients = {{flow[i], 1.}};
+		for (size_t k = 0; k < model.transport_level_vars[i].size(); k++)
+			coefficients.emplace_back(model.transport_level_vars[i][k], -double(line.capacity(level+k+1) - line.capacity(level+k)));
+		lp.add_constraint(move(coefficients), line.capacity(level));
+	}
+
+	// outgoing - incoming <= production, for every facility and item
+	for (size_t i = 0; i < factory->facilities.size(); i++)
+	{
+		const auto& facility = factory->facilities[i];
+		size_t level = initial_config.facility_levels[i];
+		for (item_t item : facility.items)
+		{
+			vector< pair<size_t, double> > coefficients;
+			for (size_t line : factory->facility_outgoing[i])
+				if (factory->transport_lines[line].item_type == item)
+					coefficients.emplace_back(flow[line], 1.);
+			for (size_t line : factory->facility_incoming[i])
+				if (factory->transport_lines[line].item_type == item)
+					coefficients.emplace_back(flow[line], -1.);
+			for (size_t k = 0; k < model.facility_level_vars[i].size(); k++)
+			{
+				double delta = facility.production(level+k+1, item) - facility.production(level+k, item);
+				if (delta != 0.)
+					coefficients.emplace_back(model.facility_level_vars[i][k], -delta);
+			}
+			lp.add_constraint(move(coefficients), facility.production(level, item));
+		}
+	}
+
+	return model;
+}
+
+Factory::FactoryConfiguration UpgradeOptimizer::configuration(const Model& model,
+	const Factory::FactoryConfiguration& initial_config, const vector<double>& x) const
+{
+	Factory::FactoryConfiguration conf = initial_config;
+	for (size_t i = 0; i < conf.facility_levels.size(); i++)
+		for (size_t var : model.facility_level_vars[i])
+			conf.facility_levels[i] += (x[var] > 0.5);
+	for (size_t i = 0; i < conf.transport_levels.size(); i++)
+		for (size_t var : model.transport_level_vars[i])
+			conf.transport_levels[i] += (x[var] > 0.5);
+	return conf;
+}
+
+double UpgradeOptimizer::relaxation_bound(const Factory::FactoryConfiguration& initial_config)
+{
+	Model model = build_model(initial_config);
+	vector<double> x;
+	double objective;
+	if (model.lp.solve(vector<double>(model.lp.cost.size(), 0.), model.lp.upper, x, objective) != LinearProgram::OPTIMAL)
+		return numeric_limits<double>::infinity();
+	return objective;
+}
+
+UpgradeOptimizer::Result UpgradeOptimizer::optimize(const Factory::FactoryConfiguration& initial_config, size_t max_nodes)
+{
+	Result result;
+	result.conf = initial_config;
+
+	Model model = build_model(initial_config);
+	size_t n = model.lp.cost.size();
+
+	// depth first branch and bound. `bound` is the parent's relaxation
+	struct BranchNode
+	{
+		vector<double> lower, upper;
+		double bound;
+	};
+	vector<BranchNode> stack;
+	stack.push_back(BranchNode{vector<double>(n, 0.), model.lp.upper, 0.});
+
+	double best = numeric_limits<double>::infinity();
+	double root_bound = -1.;
+	double unexplored_bound = numeric_limits<double>::infinity();
+
+	while (!stack.empty())
+	{
+		if (result.nodes >= max_nodes)
+		{
+			for (const auto& node : stack)
+				unexplored_bound = min(unexplored_bound, node.bound);
+			if (verbose)
+				cout << "milp: giving up after " << result.nodes << " nodes" << endl;
+			break;
+		}
+
+		BranchNode node = move(stack.back());
+		stack.pop_back();
+		if (node.bound >= best - EPS)
+			continue;
+
+		vector<double> x;
+		double objective;
+		result.nodes++;
+		auto status = model.lp.solve(node.lower, node.upper, x, objective);
+		if (status == LinearProgram::UNBOUNDED)
+			throw runtime_error("upgrade relaxation is unbounded");
+
+		if (root_bound < 0.)
+		{
+			root_bound = status == LinearProgram::OPTIMAL ? objective : numeric_limits<double>::infinity();
+			if (verbose)
+				cout << "milp: relaxation bound = " << root_bound << endl;
+		}
+		if (status == LinearProgram::INFEASIBLE || objective >= best - EPS)
+			continue;
+
+		size_t branch = NONE;
+		for (size_t var : model.integer_vars)
+			if (fabs(x[var] - round(x[var])) > 1e-6)
+			{
+				branch = var;
+				break;
+			}
+
+		if (branch == NONE)
+		{
+			Factory::FactoryConfiguration conf = configuration(model, initial_config, x);
+
+			// the fair splitting doesn't always achieve the flow the LP found.
+			// a component's validity only depends on the levels of its own
+			// facilities and transport lines, so for every invalid component,
+			// we cut off the assignment of just these.
+			size_t cuts_before = result.cuts;
+			for (int item = 0; item < MAX_ITEM; item++)
+				for (size_t c = 0; c < factory->components_per_item[item].size(); c++)
+				{
+					FlowGraph flow = factory->build_flowgraph(item_t(item), c, conf);
+					flow.calculate();
+					if (flow.is_valid())
+						continue;
+
+					const auto& component = factory->components_per_item[item][c];
+					vector< pair<size_t, double> > coefficients;
+					double ones = 0.;
+					auto add = [&](const vector<size_t>& vars)
+					{
+						for (size_t var : vars)
+						{
+							bool one = x[var] > 0.5;
+							coefficients.emplace_back(var, one ? 1. : -1.);
+							ones += one;
+						}
+					};
+					for (size_t facility : component.facilities)
+						add(model.facility_level_vars[facility]);
+					for (size_t line : component.transport_lines)
+						add(model.transport_level_vars[line]);
+
+					model.lp.add_constraint(move(coefficients), ones - 1.);
+					result.cuts++;
+				}
+
+			if (result.cuts == cuts_before)
+			{
+				best = factory->upgrade_cost(initial_config, conf);
+				result.conf = conf;
+				result.cost = best;
+				if (verbose)
+					cout << "milp: found solution, cost = " << best << " after " << result.nodes << " nodes" << endl;
+			}
+			else
+			{
+				// solve the node again, with the cuts
+				node.bound = objective;
+				stack.push_back(move(node));
+			}
+			continue;
+		}
+
+		// the "up" branch is explored first, as upgrading more tends to be valid
+		BranchNode down = node;
+		down.upper[branch] = 0.;
+		down.bound = objective;
+		node.lower[branch] = 1.;
+		node.bound = objective;
+		stack.push_back(move(down));
+		stack.push_back(move(node));
+	}
+
+	// if the search has finished, nothing cheaper than `best` exists
+	result.lower_bound = max(root_bound, min(best, unexplored_bound));
+	if (verbose)
+	{
+		if (result.cost < 0.)
+			cout << "milp: no solution found, lower bound = " << result.lower_bound << endl;
+		else
+			cout << "milp: cost = " << result.cost << ", lower bound = " << result.lower_bound << ", " << result.nodes << " nodes, " << result.cuts << " cuts" << endl;
+	}
+	return result;
+}
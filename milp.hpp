@@ -0,0 +1,87 @@
+#pragma once
+
+#include <vector>
+#include <utility>
+#include <limits>
+#include "factory.hpp"
+
+// minimize sum(cost[j] * x[j]) subject to sum(a_ij * x[j]) <= b_i and
+// lower[j] <= x[j] <= upper[j]. solved by a dense two-phase simplex, which is
+// plenty for the upgrade problems of small factories. the tableau has a row
+// per constraint and a column per variable, so the time grows with the cube
+// of the factory's size.
+struct LinearProgram
+{
+	enum Status { OPTIMAL, INFEASIBLE, UNBOUNDED };
+
+	struct Constraint
+	{
+		std::vector< std::pair<size_t, double> > coefficients; // (variable, a_ij)
+		double rhs;
+	};
+
+	std::vector<double> cost;
+	std::vector<double> upper; // lower bounds are 0
+	std::vector<Constraint> constraints;
+
+	size_t add_variable(double cost_, double upper_ = std::numeric_limits<double>::infinity());
+	void add_constraint(std::vector< std::pair<size_t, double> > coefficients, double rhs);
+
+	// lower and upper override the variables' bounds. variables whose bounds
+	// are equal are eliminated before solving.
+	Status solve(const std::vector<double>& lower, const std::vector<double>& upper_,
+		std::vector<double>& x, double& objective) const;
+};
+
+// finds the cheapest upgrade of a configuration by branch and bound over a
+// mixed integer program, as an alternative to ActionGraph's search:
+//
+// every upgrade level above the initial one is a binary variable (a level
+// can only be taken if the one below is), every transport line carries a
+// continuous flow below its capacity, and every facility may send out at
+// most what it receives plus what it produces of each item. this is
+// necessary for the simulation to be valid, but not sufficient, because
+// the simulation splits flows fairly (and rounds them down) instead of
+// optimally. integer solutions which the simulation rejects are cut off and
+// the search goes on, so the result is the cheapest configuration the
+// simulation accepts.
+//
+// the LP relaxation at the root is a lower bound for any upgrade. it is
+// much cheaper than the branch and bound, but not than ActionGraph's search
+// on large factories.
+struct UpgradeOptimizer
+{
+	UpgradeOptimizer(const Factory* factory_) : factory(factory_) {}
+
+	struct Result
+	{
+		Factory::FactoryConfiguration conf;
+		double cost = -1.; // negative if no solution was found
+		double lower_bound = 0.; // no valid configuration is cheaper
+		size_t nodes = 0; // branch and bound nodes solved
+		size_t cuts = 0; // integer solutions rejected by the simulation
+
+		bool optimal() const { return cost >= 0. && cost <= lower_bound + 1e-9; }
+	};
+
+	const Factory* factory;
+	bool verbose = false;
+
+	Result optimize(const Factory::FactoryConfiguration& initial_config, size_t max_nodes = 10000);
+	// the LP relaxation at the root, infinite if not even that is feasible
+	double relaxation_bound(const Factory::FactoryConfiguration& initial_config);
+
+	private:
+		struct Model
+		{
+			LinearProgram lp;
+			// level_vars[k] is the variable for upgrading by k+1 levels
+			std::vector< std::vector<size_t> > facility_level_vars;
+			std::vector< std::vector<size_t> > transport_level_vars;
+			std::vector<size_t> integer_vars;
+		};
+
+		Model build_model(const Factory::FactoryConfiguration& initial_config) const;
+		Factory::FactoryConfiguration configuration(const Model& model,
+			const Factory::FactoryConfiguration& initial_config, const std::vector<double>& x) const;
+};
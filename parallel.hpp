@@ -0,0 +1,52 @@
+#pragma once
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <exception>
+#include <cstddef>
+
+// calls f(i, thread_index) for all i < n, on up to n_threads threads, and
+// returns when all are done. the threads take the next i whenever they're
+// done with one, so work items of very different size are fine. callers can
+// keep scratch space per thread_index. the first exception thrown by f is
+// rethrown here, after the remaining calls are skipped.
+template <typename F> void parallel_for(size_t n, size_t n_threads, F f)
+{
+	if (n_threads <= 1 || n <= 1)
+	{
+		for (size_t i = 0; i < n; i++)
+			f(i, size_t(0));
+		return;
+	}
+
+	std::atomic<size_t> next(0);
+	std::exception_ptr error;
+	std::mutex error_mutex;
+	auto worker = [&](size_t thread_index)
+	{
+		for (size_t i = next++; i < n; i = next++)
+		{
+			try
+			{
+				f(i, thread_index);
+			}
+			catch (...)
+			{
+				std::lock_guard<std::mutex> lock(error_mutex);
+				if (!error)
+					error = std::current_exception();
+				next = n;
+			}
+		}
+	};
+
+	std::vector<std::thread> threads;
+	for (size_t t = 0; t < n_threads && t < n; t++)
+		threads.emplace_back(worker, t);
+	for (auto& t : threads)
+		t.join();
+
+	if (error)
+		std::rethrow_exception(error);
+}
@@ -0,0 +1,41 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <limits>
+
+// production rates and transport capacities are fixed point numbers:
+// RATE_SCALE units are one item per second. both the width and the scale can
+// be set at build time (see config.mk). 64 bits are the default, so that even
+// the sums over huge hubs can't overflow; 32 bits fit twice as many lanes into
+// a vector register in BatchFlowGraph, but only suit small factories.
+#ifndef RATE_BITS
+	#define RATE_BITS 64
+#endif
+#ifndef RATE_SCALE
+	#define RATE_SCALE 1000
+#endif
+
+#if RATE_BITS == 64
+	typedef int64_t rate_t;
+#elif RATE_BITS == 32
+	typedef int32_t rate_t;
+#else
+	#error "RATE_BITS must be 32 or 64"
+#endif
+
+// rates in the factories made by read_factory() are in items per second times this
+constexpr rate_t SCALING_FACTOR = RATE_SCALE;
+
+// the largest rate of a single facility or transport line
+constexpr rate_t MAX_RATE = RATE_BITS == 64 ? rate_t(int64_t(1) << 36) : rate_t(1 << 23);
+
+// a node sums up the flows of its incoming edges and its own production, so
+// this many incoming edges (2^27-2, or 254 with 32 bits) can't overflow.
+// Factory::initialize() rejects facilities with more.
+constexpr size_t MAX_FAN_IN = size_t(std::numeric_limits<rate_t>::max() / MAX_RATE) - 1;
+
+// up to this many incoming edges (2^16-1 with 64 bits), the sums also stay
+// below 2^52 and are exact as doubles, which BatchFlowGraph relies on to
+// vectorize its divisions. it divides exactly, but slower, for nodes with more.
+constexpr size_t MAX_DOUBLE_FAN_IN = size_t(int64_t(1) << 52) / size_t(MAX_RATE) - 1 < MAX_FAN_IN
+	? size_t(int64_t(1) << 52) / size_t(MAX_RATE) - 1 : MAX_FAN_IN;
@@ -3,14 +3,16 @@
 
 #include <iostream>
 #include <fstream>
+#include <sstream>
+#include <cmath>
 #include <stdexcept>
+#include <random>
+#include <algorithm>
 
 #include <map>
 
 using namespace std;
 
-constexpr int SCALING_FACTOR = 1000;
-
 static map<string, map<item_t, double>> recipes = { // FIXME: this is a misnomer
 	{"coal", {{COAL,1}}},
 	{"iron-ore", {{IRON_ORE,1}}},
@@ -42,7 +44,88 @@ static map<string, item_t> item_lookup = {
 	{"pumpjack", PUMPJACK}
 };
 
-Factory read_factory(string file)
+// converts items per second to a rate, which must not exceed MAX_RATE
+static rate_t to_rate(double items_per_second)
+{
+	double rate = round(double(SCALING_FACTOR) * items_per_second);
+	if (!(fabs(rate) <= double(MAX_RATE)))
+		throw runtime_error("a rate of " + to_string(items_per_second) + " items per second is out of range (RATE_BITS=" + to_string(RATE_BITS) + ")");
+	return rate_t(rate);
+}
+
+// facilities have five levels, which don't cost anything
+static const size_t FACILITY_LEVELS = 5;
+
+Factory::Facility make_facility(const string& recipe, double current, double maximum)
+{
+	Factory::FacilityPlan plan;
+
+	if (recipe.empty())
+	{
+		plan.incremental_cost.assign(1, 0.); // a single level without a recipe. this is a splitter node
+	}
+	else
+	{
+		for (auto iter : recipes.at(recipe))
+		{
+			to_rate(iter.second * max(fabs(current), fabs(maximum))); // the fastest level must be in range
+			plan.recipe.emplace_back(iter.first, double(SCALING_FACTOR) * iter.second);
+		}
+		plan.incremental_cost.assign(FACILITY_LEVELS, 0.);
+	}
+
+	return Factory::Facility(Factory::intern(move(plan)), current, maximum);
+}
+
+static const Factory::TransportPlan* builtin_transport_plan()
+{
+	static const Factory::TransportPlan* plan = Factory::intern(Factory::TransportPlan{{
+		{rate_t(SCALING_FACTOR * 1*13.3), 1.}, // one yellow
+		{rate_t(SCALING_FACTOR * 2*13.3), 1.}, // two yellow
+		{rate_t(SCALING_FACTOR * 3*13.3), 4.}, // red+yellow
+		{rate_t(SCALING_FACTOR * 4*13.3), 4.}, // red+red
+		{rate_t(SCALING_FACTOR * 5*13.3), 15.}, // blue+red
+		{rate_t(SCALING_FACTOR * 6*13.3), 15.} // blue+blue
+	}});
+	return plan;
+}
+
+static const Factory::TransportPlan* transport_plan = nullptr; // set by load_transport_tiers()
+
+void load_transport_tiers(const string& file)
+{
+	ifstream f(file);
+	if (!f.good())
+		throw runtime_error("could not open file '"+file+"'");
+
+	Factory::TransportPlan plan;
+	string line;
+	while (getline(f, line))
+	{
+		line = line.substr(0, line.find('#'));
+		istringstream fields(line);
+		double capacity, cost;
+		if (!(fields >> capacity))
+			continue; // empty line
+		if (!(fields >> cost) || capacity < 0. || cost < 0.)
+			throw runtime_error("invalid tier '" + line + "' in '" + file + "'");
+		if (!plan.tiers.empty() && to_rate(capacity) < plan.tiers.back().capacity)
+			throw runtime_error("tiers in '" + file + "' must not lose capacity");
+		plan.tiers.push_back(Factory::TransportLineConfiguration{to_rate(capacity), cost});
+	}
+	if (plan.tiers.empty())
+		throw runtime_error("'" + file + "' has no tiers");
+
+	transport_plan = Factory::intern(move(plan));
+}
+
+Factory::TransportLine make_transport_line(size_t from, size_t to, const string& item, double dist)
+{
+	const Factory::TransportPlan* plan = transport_plan ? transport_plan : builtin_transport_plan();
+	return Factory::TransportLine(item_lookup.at(item), from, to, plan, dist);
+}
+
+Factory read_factory(string file, bool verbose)
 {
 	ifstream f(file);
 	if (!f.good())
@@ -62,11 +145,7 @@ Factory read_factory(string file)
 	
 		if (p1 == line.length()-1)
 		{
-			vector<Factory::FacilityConfiguration> upgrade_plan;
-			Factory::FacilityConfiguration conf;
-			upgrade_plan.push_back(conf); // push an empty configuration. this is a splitter node
-
-			factory.facilities.emplace_back(upgrade_plan);
+			factory.facilities.push_back(make_facility("", 0., 0.));
 		}
 		else
 		{
@@ -82,20 +161,10 @@ Factory read_factory(string file)
 			double current = stod(line.substr(p2+1, p3-p2-1));
 			double maximum = stod(line.substr(p3+1));
 
-			cout << "recipe '" << recipe << "' with " << current << "/" << maximum << endl;
-
-			vector<Factory::FacilityConfiguration> upgrade_plan;
-			
-			for (int i=0; i<5; i++)
-			{
-				Factory::FacilityConfiguration conf;
-				
-				for (auto iter : recipes.at(recipe))
-					conf.production_or_consumption[iter.first] = int(SCALING_FACTOR * iter.second * (current + (maximum-current)*i/5.));
-				upgrade_plan.push_back(conf);
-			}
+			if (verbose)
+				cout << "recipe '" << recipe << "' with " << current << "/" << maximum << endl;
 
-			factory.facilities.emplace_back(upgrade_plan);
+			factory.facilities.push_back(make_facility(recipe, current, maximum));
 		}
 	}
 
@@ -122,18 +191,76 @@ Factory read_factory(string file)
 		bool exists = (dist_x.substr(dist_x.length()-1) != "x");
 		double dist = stod(dist_x);
 
-		cout << "transport of " << item << " " << from << "->" << to << ", distance " << dist << " (line exists=" << exists << ")" << endl;
+		if (verbose)
+			cout << "transport of " << item << " " << from << "->" << to << ", distance " << dist << " (line exists=" << exists << ")" << endl;
 
-		vector<Factory::TransportLineConfiguration> upgrade_plan;
+		factory.transport_lines.push_back(make_transport_line(from-1, to-1, item, dist));
+	}
+
+	return factory;
+}
 
-		upgrade_plan.emplace_back(Factory::TransportLineConfiguration{int(SCALING_FACTOR * 1*13.3), dist}); // one yellow
-		upgrade_plan.emplace_back(Factory::TransportLineConfiguration{int(SCALING_FACTOR * 2*13.3), dist}); // two yellow
-		upgrade_plan.emplace_back(Factory::TransportLineConfiguration{int(SCALING_FACTOR * 3*13.3), 4*dist}); // red+yellow
-		upgrade_plan.emplace_back(Factory::TransportLineConfiguration{int(SCALING_FACTOR * 4*13.3), 4*dist}); // red+red
-		upgrade_plan.emplace_back(Factory::TransportLineConfiguration{int(SCALING_FACTOR * 5*13.3), 15*dist}); // blue+red
-		upgrade_plan.emplace_back(Factory::TransportLineConfiguration{int(SCALING_FACTOR * 6*13.3), 15*dist}); // blue+blue
+Factory generate_factory(size_t n_facilities, unsigned seed)
+{
+	static const vector<string> raw_recipes = {"coal", "iron-ore", "copper-ore"};
+	static const vector<string> recipes_with_input = {"iron-plate", "copper-plate", "steel-plate", "pipe", "circuit", "red-pot", "green-pot", "stuff"};
+
+	mt19937 rng(seed);
+	auto uniform = [&](double a, double b) { return uniform_real_distribution<double>(a, b)(rng); };
+	auto pick = [&](size_t n) { return size_t(uniform_int_distribution<size_t>(0, n-1)(rng)); };
+
+	Factory factory;
+	vector< vector<size_t> > producers(MAX_ITEM);
+
+	while (factory.facilities.size() < n_facilities)
+	{
+		// the first third mines raw resources, the rest processes what's already there
+		vector<string> candidates;
+		if (factory.facilities.size() >= n_facilities/3 + 1)
+			for (const auto& recipe : recipes_with_input)
+			{
+				bool available = true;
+				for (auto iter : recipes.at(recipe))
+					if (iter.second < 0 && producers[iter.first].empty())
+						available = false;
+				if (available)
+					candidates.push_back(recipe);
+			}
+		if (candidates.empty())
+			candidates = raw_recipes;
+
+		string recipe = candidates[pick(candidates.size())];
+		double current = candidates == raw_recipes ? uniform(10., 40.) : uniform(5., 20.);
+		size_t index = factory.facilities.size();
+		factory.facilities.push_back(make_facility(recipe, current, current * uniform(1.5, 3.)));
+
+		for (auto iter : recipes.at(recipe))
+		{
+			if (iter.second >= 0)
+				continue;
+
+			// take the input from one or two producers, sometimes through a splitter
+			const auto& candidate_producers = producers[iter.first];
+			size_t n_inputs = (candidate_producers.size() > 1 && pick(3) == 0) ? 2 : 1;
+			size_t target = index;
+			if (pick(5) == 0)
+			{
+				target = factory.facilities.size();
+				factory.facilities.push_back(make_facility("", 0., 0.));
+				factory.transport_lines.push_back(make_transport_line(target, index, item_name.at(iter.first), double(1 + pick(8))));
+			}
+
+			size_t first = pick(candidate_producers.size());
+			for (size_t i = 0; i < n_inputs; i++)
+			{
+				size_t producer = candidate_producers[(first + i) % candidate_producers.size()];
+				factory.transport_lines.push_back(make_transport_line(producer, target, item_name.at(iter.first), double(1 + pick(8))));
+			}
+		}
 
-		factory.transport_lines.emplace_back(item_lookup.at(item), from-1, to-1, upgrade_plan);
+		for (auto iter : recipes.at(recipe))
+			if (iter.second > 0)
+				producers[iter.first].push_back(index);
 	}
 
 	return factory;
@@ -3,5 +3,20 @@
 #include <string>
 #include "factory.hpp"
 
-Factory read_factory(std::string file);
+Factory read_factory(std::string file, bool verbose = true);
 
+// create facilities and transport lines the same way read_factory() does.
+// an empty recipe creates a splitter.
+Factory::Facility make_facility(const std::string& recipe, double current, double maximum);
+Factory::TransportLine make_transport_line(size_t from, size_t to, const std::string& item, double dist);
+
+// replaces the built-in yellow, red and blue belt tiers, which transport lines
+// are upgraded through, for all transport lines made afterwards. every line
+// of the file is "<capacity in items per second> <cost per unit of distance>",
+// for the tiers from lowest to highest. '#' starts a comment.
+void load_transport_tiers(const std::string& file);
+
+// generates a random factory of about n_facilities facilities from the same
+// recipes. transport lines lead from a facility to a newer one, or through a
+// splitter feeding only that newer one, so the factory is acyclic. used for testing the optimizers against each other.
+Factory generate_factory(size_t n_facilities, unsigned seed);
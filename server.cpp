@@ -0,0 +1,645 @@
+#include <string>
+#include <vector>
+#include <map>
+#include <deque>
+#include <memory>
+#include <sstream>
+#include <iostream>
+#include <stdexcept>
+#include <thread>
+#include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
+
+#include <cerrno>
+#include <cstring>
+#include <csignal>
+#include <chrono>
+
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "server.hpp"
+#include "factory.hpp"
+#include "actiongraph.hpp"
+#include "read_factory.h"
+
+using namespace std;
+
+// a client we can send response lines to. lines may be sent from multiple
+// worker threads at once.
+struct Connection
+{
+	Connection(int fd_, bool owns_fd_) : fd(fd_), owns_fd(owns_fd_) {}
+	~Connection()
+	{
+		if (owns_fd)
+			close(fd);
+	}
+
+	void send(const string& line)
+	{
+		lock_guard<mutex> guard(write_mutex);
+		string data = line + "\n";
+		size_t written = 0;
+		while (written < data.size())
+		{
+			ssize_t n = write(fd, data.data() + written, data.size() - written);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0)
+				return; // client is gone. nothing we can do about it.
+			written += size_t(n);
+		}
+	}
+
+	// requests of this connection that haven't been answered yet
+	void add_pending()
+	{
+		lock_guard<mutex> guard(pending_mutex);
+		pending++;
+	}
+	void remove_pending()
+	{
+		{
+			lock_guard<mutex> guard(pending_mutex);
+			pending--;
+		}
+		pending_cv.notify_all();
+	}
+	void wait_for_pending()
+	{
+		unique_lock<mutex> guard(pending_mutex);
+		pending_cv.wait(guard, [this]{ return pending == 0; });
+	}
+
+	int fd;
+	bool owns_fd;
+	mutex write_mutex;
+
+	mutex pending_mutex;
+	condition_variable pending_cv;
+	size_t pending = 0;
+};
+
+struct LoadedFactory
+{
+	LoadedFactory() : graph(&factory)
+	{
+		graph.verbose = false;
+	}
+
+	shared_timed_mutex lock; // simulate/optimize share it, edits are exclusive
+	Factory factory;
+	ActionGraph graph; // kept around for its simulation cache
+};
+
+struct Request
+{
+	shared_ptr<Connection> connection;
+	string line;
+};
+
+class Server
+{
+	public:
+		Server(size_t n_threads);
+		~Server();
+
+		void enqueue(shared_ptr<Connection> connection, string line);
+		void wait_until_idle();
+
+	private:
+		void worker();
+		string handle(const string& line);
+
+		string cmd_load(istream& args);
+		string cmd_unload(istream& args);
+		string cmd_simulate(istream& args);
+		string cmd_optimize(istream& args);
+		string cmd_optimize_within(istream& args);
+		string cmd_upgrade_gains(istream& args);
+		string cmd_utilization(istream& args);
+		string cmd_edit(istream& args);
+
+		shared_ptr<LoadedFactory> lookup(const string& name);
+
+		mutex factories_mutex;
+		map< string, shared_ptr<LoadedFactory> > factories;
+
+		mutex queue_mutex;
+		condition_variable queue_cv;
+		condition_variable idle_cv;
+		deque<Request> queue;
+		size_t busy = 0;
+		bool shutting_down = false;
+		vector<thread> workers;
+};
+
+Server::Server(size_t n_threads)
+{
+	for (size_t i = 0; i < n_threads; i++)
+		workers.emplace_back(&Server::worker, this);
+}
+
+Server::~Server()
+{
+	{
+		lock_guard<mutex> guard(queue_mutex);
+		shutting_down = true;
+	}
+	queue_cv.notify_all();
+	for (auto& t : workers)
+		t.join();
+}
+
+void Server::enqueue(shared_ptr<Connection> connection, string line)
+{
+	connection->add_pending();
+	{
+		lock_guard<mutex> guard(queue_mutex);
+		queue.push_back(Request{move(connection), move(line)});
+	}
+	queue_cv.notify_one();
+}
+
+void Server::wait_until_idle()
+{
+	unique_lock<mutex> guard(queue_mutex);
+	idle_cv.wait(guard, [this]{ return queue.empty() && busy == 0; });
+}
+
+void Server::worker()
+{
+	while (true)
+	{
+		Request request;
+		{
+			unique_lock<mutex> guard(queue_mutex);
+			queue_cv.wait(guard, [this]{ return shutting_down || !queue.empty(); });
+			if (queue.empty())
+				return;
+			request = move(queue.front());
+			queue.pop_front();
+			busy++;
+		}
+
+		request.connection->send(handle(request.line));
+		request.connection->remove_pending();
+
+		{
+			lock_guard<mutex> guard(queue_mutex);
+			busy--;
+		}
+		idle_cv.notify_all();
+	}
+}
+
+// "-" means "all zero", everything else is a comma separated list.
+static vector<size_t> parse_levels(const string& text, size_t count)
+{
+	if (text == "-")
+		return vector<size_t>(count, 0);
+
+	vector<size_t> result;
+	istringstream stream(text);
+	string level;
+	while (getline(stream, level, ','))
+		result.push_back(stoul(level));
+
+	if (result.size() != count)
+		throw runtime_error("expected " + to_string(count) + " levels, got " + to_string(result.size()));
+	return result;
+}
+
+static string format_list(const vector<size_t>& values)
+{
+	if (values.empty())
+		return "-";
+
+	string result;
+	for (size_t v : values)
+		result += to_string(v) + ",";
+	result.pop_back();
+	return result;
+}
+
+static Factory::FactoryConfiguration parse_configuration(istream& args, const Factory& factory)
+{
+	string facility_levels, transport_levels;
+	if (!(args >> facility_levels >> transport_levels))
+		throw runtime_error("missing configuration");
+
+	Factory::FactoryConfiguration conf;
+	conf.facility_levels = parse_levels(facility_levels, factory.facilities.size());
+	conf.transport_levels = parse_levels(transport_levels, factory.transport_lines.size());
+
+	for (size_t i = 0; i < conf.facility_levels.size(); i++)
+		if (conf.facility_levels[i] >= factory.facilities[i].levels())
+			throw runtime_error("invalid level for facility " + to_string(i));
+	for (size_t i = 0; i < conf.transport_levels.size(); i++)
+		if (conf.transport_levels[i] >= factory.transport_lines[i].levels())
+			throw runtime_error("invalid level for transport line " + to_string(i));
+
+	return conf;
+}
+
+string Server::handle(const string& line)
+{
+	istringstream args(line);
+	string id, command;
+	if (!(args >> id))
+		return "? error empty request";
+	if (!(args >> command))
+		return id + " error missing command";
+
+	try
+	{
+		string result;
+		if (command == "load")
+			result = cmd_load(args);
+		else if (command == "unload")
+			result = cmd_unload(args);
+		else if (command == "simulate")
+			result = cmd_simulate(args);
+		else if (command == "optimize")
+			result = cmd_optimize(args);
+		else if (command == "optimize-within")
+			result = cmd_optimize_within(args);
+		else if (command == "upgrade-gains")
+			result = cmd_upgrade_gains(args);
+		else if (command == "utilization")
+			result = cmd_utilization(args);
+		else if (command == "edit")
+			result = cmd_edit(args);
+		else
+			throw runtime_error("unknown command '" + command + "'");
+
+		return id + " ok" + (result.empty() ? "" : " " + result);
+	}
+	catch (const exception& e)
+	{
+		return id + " error " + e.what();
+	}
+}
+
+shared_ptr<LoadedFactory> Server::lookup(const string& name)
+{
+	lock_guard<mutex> guard(factories_mutex);
+	auto iter = factories.find(name);
+	if (iter == factories.end())
+		throw runtime_error("no factory named '" + name + "'");
+	return iter->second;
+}
+
+// load <name> <file>
+string Server::cmd_load(istream& args)
+{
+	string name, file;
+	if (!(args >> name >> file))
+		throw runtime_error("usage: load <name> <file>");
+
+	auto entry = make_shared<LoadedFactory>();
+	entry->factory = read_factory(file, false);
+	entry->factory.initialize();
+	string result = to_string(entry->factory.facilities.size()) + " " + to_string(entry->factory.transport_lines.size());
+
+	lock_guard<mutex> guard(factories_mutex);
+	factories[name] = move(entry);
+	return result;
+}
+
+// unload <name>
+string Server::cmd_unload(istream& args)
+{
+	string name;
+	if (!(args >> name))
+		throw runtime_error("usage: unload <name>");
+
+	lock_guard<mutex> guard(factories_mutex);
+	if (factories.erase(name) == 0)
+		throw runtime_error("no factory named '" + name + "'");
+	return "";
+}
+
+// simulate <name> <facility levels> <transport levels>
+// answers "valid", or "invalid" followed by the list of unsatisfied facilities.
+string Server::cmd_simulate(istream& args)
+{
+	string name;
+	if (!(args >> name))
+		throw runtime_error("usage: simulate <name> <facility levels> <transport levels>");
+
+	auto entry = lookup(name);
+	shared_lock<shared_timed_mutex> guard(entry->lock);
+	const Factory& factory = entry->factory;
+	auto conf = parse_configuration(args, factory);
+
+	vector<bool> unsatisfied(factory.facilities.size(), false);
+	for (int item = 0; item < MAX_ITEM; item++)
+	{
+		FlowGraph flow = factory.build_flowgraph(item_t(item), conf);
+		flow.calculate();
+		for (size_t i = 0; i < flow.nodes.size(); i++)
+			if (flow.nodes[i].incoming() < -flow.nodes[i].max_production)
+				unsatisfied[factory.facility_toposort[item][i]] = true;
+	}
+
+	vector<size_t> unsatisfied_list;
+	for (size_t i = 0; i < unsatisfied.size(); i++)
+		if (unsatisfied[i])
+			unsatisfied_list.push_back(i);
+
+	if (unsatisfied_list.empty())
+		return "valid";
+	else
+		return "invalid " + format_list(unsatisfied_list);
+}
+
+// optimize <name> <facility levels> <transport levels> [<prior facility levels> <prior transport levels>]
+// answers "<cost> <facility levels> <transport levels>", or "none".
+string Server::cmd_optimize(istream& args)
+{
+	string name;
+	if (!(args >> name))
+		throw runtime_error("usage: optimize <name> <facility levels> <transport levels> [<prior solution>]");
+
+	auto entry = lookup(name);
+	shared_lock<shared_timed_mutex> guard(entry->lock);
+	auto conf = parse_configuration(args, entry->factory);
+
+	pair<Factory::FactoryConfiguration, double> result;
+	if (args >> ws && !args.eof())
+		result = entry->graph.dijkstra(conf, parse_configuration(args, entry->factory));
+	else
+		result = entry->graph.dijkstra(conf);
+
+	if (result.second < 0.)
+		return "none";
+
+	ostringstream out;
+	out << result.second << " " << format_list(result.first.facility_levels) << " " << format_list(result.first.transport_levels);
+	return out.str();
+}
+
+// optimize-within <name> <milliseconds> <facility levels> <transport levels>
+// answers "<cost> <lower bound> <facility levels> <transport levels>", or "none <lower bound>".
+string Server::cmd_optimize_within(istream& args)
+{
+	string name;
+	double milliseconds;
+	if (!(args >> name >> milliseconds))
+		throw runtime_error("usage: optimize-within <name> <milliseconds> <facility levels> <transport levels>");
+
+	auto entry = lookup(name);
+	shared_lock<shared_timed_mutex> guard(entry->lock);
+	auto conf = parse_configuration(args, entry->factory);
+
+	ActionGraph::SearchLimits limits;
+	limits.max_seconds = milliseconds / 1000.;
+	auto result = entry->graph.anytime(conf, limits);
+
+	ostringstream out;
+	if (result.cost < 0.)
+		out << "none " << result.lower_bound;
+	else
+		out << result.cost << " " << result.lower_bound << " " << format_list(result.conf.facility_levels) << " " << format_list(result.conf.transport_levels);
+	return out.str();
+}
+
+// upgrade-gains <name> <facility levels> <transport levels> [<count>]
+// answers the best <count> (default: all) single upgrades, best first, as a
+// comma separated list of "f<index>:<gain>:<cost>" or "l<index>:<gain>:<cost>"
+// for facilities and transport lines, or "-".
+string Server::cmd_upgrade_gains(istream& args)
+{
+	string name;
+	if (!(args >> name))
+		throw runtime_error("usage: upgrade-gains <name> <facility levels> <transport levels> [<count>]");
+
+	auto entry = lookup(name);
+	shared_lock<shared_timed_mutex> guard(entry->lock);
+	auto conf = parse_configuration(args, entry->factory);
+	size_t count = SIZE_MAX;
+	args >> count;
+
+	auto gains = entry->factory.upgrade_gains(conf);
+	if (gains.size() > count)
+		gains.resize(count);
+	if (gains.empty())
+		return "-";
+
+	ostringstream out;
+	for (const auto& g : gains)
+		out << (g.is_transport_line ? "l" : "f") << g.index << ":" << g.gain << ":" << g.cost << ",";
+	string result = out.str();
+	result.pop_back();
+	return result;
+}
+
+// utilization <name> <facility levels> <transport levels>
+// answers "settled" or "unsettled", followed by the comma separated
+// utilization of every facility when the recipe ratios are enforced.
+string Server::cmd_utilization(istream& args)
+{
+	string name;
+	if (!(args >> name))
+		throw runtime_error("usage: utilization <name> <facility levels> <transport levels>");
+
+	auto entry = lookup(name);
+	shared_lock<shared_timed_mutex> guard(entry->lock);
+	auto conf = parse_configuration(args, entry->factory);
+
+	// the server's workers already keep the cores busy
+	Factory::CoupledOptions options;
+	options.n_threads = 1;
+	auto coupled = entry->factory.simulate_coupled(conf, options);
+
+	ostringstream out;
+	out << (coupled.converged ? "settled" : "unsettled");
+	for (size_t i = 0; i < coupled.utilization.size(); i++)
+		out << (i ? "," : " ") << coupled.utilization[i];
+	return out.str();
+}
+
+// edit <name> add-facility <recipe> <current>/<max>   (recipe "splitter" creates a splitter)
+// edit <name> add-line <from> <to> <item> <distance>
+// edit <name> remove-facility <index>   (also removes its transport lines)
+// edit <name> remove-line <index>
+// indices are zero-based. answers the index of added facilities/lines.
+// removals move the last facility/line into the freed index.
+string Server::cmd_edit(istream& args)
+{
+	string name, what;
+	if (!(args >> name >> what))
+		throw runtime_error("usage: edit <name> <edit command> <args...>");
+
+	auto entry = lookup(name);
+	unique_lock<shared_timed_mutex> guard(entry->lock);
+	Factory& factory = entry->factory;
+	string result;
+
+	if (what == "add-facility")
+	{
+		string recipe, rates;
+		if (!(args >> recipe))
+			throw runtime_error("usage: add-facility <recipe> <current>/<max>");
+		if (recipe == "splitter")
+			result = to_string(factory.add_facility(make_facility("", 0., 0.)));
+		else
+		{
+			if (!(args >> rates) || rates.find('/') == string::npos)
+				throw runtime_error("usage: add-facility <recipe> <current>/<max>");
+			size_t slash = rates.find('/');
+			result = to_string(factory.add_facility(make_facility(recipe, stod(rates.substr(0, slash)), stod(rates.substr(slash+1)))));
+		}
+	}
+	else if (what == "add-line")
+	{
+		size_t from, to;
+		string item;
+		double dist;
+		if (!(args >> from >> to >> item >> dist))
+			throw runtime_error("usage: add-line <from> <to> <item> <distance>");
+		result = to_string(factory.add_transport_line(make_transport_line(from, to, item, dist)));
+	}
+	else if (what == "remove-facility")
+	{
+		size_t index;
+		if (!(args >> index))
+			throw runtime_error("usage: remove-facility <index>");
+		factory.remove_facility(index);
+	}
+	else if (what == "remove-line")
+	{
+		size_t index;
+		if (!(args >> index))
+			throw runtime_error("usage: remove-line <index>");
+		factory.remove_transport_line(index);
+	}
+	else
+		throw runtime_error("unknown edit command '" + what + "'");
+
+	return result;
+}
+
+// requests which change the set of factories or a factory itself
+static bool is_barrier(const string& line)
+{
+	istringstream args(line);
+	string id, command;
+	args >> id >> command;
+	return command == "load" || command == "unload" || command == "edit";
+}
+
+// enough for the levels of a few million facilities
+static const size_t MAX_LINE_LENGTH = 64 << 20;
+
+// requests of one connection are answered concurrently and possibly out of
+// order, except for barriers: they wait for all earlier requests of the
+// connection, and all later requests wait for them. clients sending a line
+// longer than MAX_LINE_LENGTH are dropped.
+static void serve_connection(Server& server, shared_ptr<Connection> connection, int in_fd)
+{
+	string buffer;
+	size_t scanned = 0; // buffer has no newline before this
+	char chunk[4096];
+	while (true)
+	{
+		ssize_t n = read(in_fd, chunk, sizeof(chunk));
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+
+		buffer.append(chunk, size_t(n));
+		size_t pos;
+		while ((pos = buffer.find('\n', scanned)) != string::npos)
+		{
+			string line = buffer.substr(0, pos);
+			buffer.erase(0, pos+1);
+			scanned = 0;
+			if (!line.empty() && line.back() == '\r')
+				line.pop_back();
+			if (line.empty())
+				continue;
+
+			if (is_barrier(line))
+			{
+				connection->wait_for_pending();
+				server.enqueue(connection, move(line));
+				connection->wait_for_pending();
+			}
+			else
+				server.enqueue(connection, move(line));
+		}
+
+		// what's left is the beginning of a line
+		scanned = buffer.size();
+		if (buffer.size() > MAX_LINE_LENGTH)
+		{
+			cerr << "dropping a client whose request is longer than " << MAX_LINE_LENGTH << " bytes" << endl;
+			connection->send("- error request too long");
+			break;
+		}
+	}
+}
+
+int run_server(const string& socket_path, size_t n_threads)
+{
+	// stdout belongs to the protocol. send all the debugging chatter elsewhere.
+	cout.rdbuf(cerr.rdbuf());
+
+	// a client that goes away before its answers are sent must not kill us.
+	// Connection::send() sees the EPIPE instead.
+	signal(SIGPIPE, SIG_IGN);
+
+	Server server(max<size_t>(n_threads, 1));
+
+	if (socket_path.empty())
+	{
+		serve_connection(server, make_shared<Connection>(STDOUT_FILENO, false), STDIN_FILENO);
+		server.wait_until_idle(); // answer everything before we quit on EOF
+		return 0;
+	}
+
+	sockaddr_un addr = {};
+	addr.sun_family = AF_UNIX;
+	if (socket_path.size() >= sizeof(addr.sun_path))
+		throw runtime_error("socket path too long");
+	socket_path.copy(addr.sun_path, socket_path.size());
+
+	// replace stale sockets from earlier runs, but nothing else.
+	struct stat st;
+	if (stat(socket_path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode))
+		unlink(socket_path.c_str());
+
+	int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listen_fd < 0
+		|| ::bind(listen_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0
+		|| listen(listen_fd, 16) != 0)
+		throw runtime_error("could not listen on '" + socket_path + "'");
+
+	while (true)
+	{
+		int client_fd = accept(listen_fd, nullptr, nullptr);
+		if (client_fd < 0)
+		{
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM)
+			{
+				// out of resources until some clients are gone. don't spin meanwhile.
+				cerr << "accept: " << strerror(errno) << ", retrying" << endl;
+				this_thread::sleep_for(chrono::milliseconds(100));
+				continue;
+			}
+			throw runtime_error("accept failed on '" + socket_path + "': " + strerror(errno));
+		}
+
+		// the socket is closed when the last pending answer has been sent.
+		thread(serve_connection, ref(server), make_shared<Connection>(client_fd, true), client_fd).detach();
+	}
+}
@@ -0,0 +1,9 @@
+#pragma once
+#include <string>
+#include <cstddef>
+
+// runs the solver daemon, which keeps factories loaded between requests.
+// requests are read line by line from stdin, or from clients connecting to
+// the unix domain socket at socket_path if it is non-empty. they are answered
+// concurrently by a pool of n_threads workers. see doc/protocol.md.
+int run_server(const std::string& socket_path, size_t n_threads);
@@ -0,0 +1,227 @@
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+#include <limits>
+
+#include "timesim.hpp"
+
+using namespace std;
+
+TimeSimulation::TimeSimulation(const Factory* factory_, const Factory::FactoryConfiguration& conf_,
+	const vector<double>& buffer_capacity) :
+	factory(factory_), conf(conf_), facility_buffer_capacity(buffer_capacity), items(MAX_ITEM)
+{
+	if (buffer_capacity.size() != factory->facilities.size())
+		throw runtime_error("need a buffer capacity for every facility");
+
+	for (int item = 0; item < MAX_ITEM; item++)
+		rebuild(item_t(item));
+}
+
+// sets up the item's flowgraph for the current levels. keeps the buffers.
+void TimeSimulation::rebuild(item_t item)
+{
+	ItemState& state = items[item];
+	state.flowgraph = factory->build_flowgraph(item, conf);
+
+	size_t n = state.flowgraph.nodes.size();
+	if (state.level.size() != n)
+	{
+		state.level.assign(n, 0.);
+		state.rate.assign(n, 0.);
+		state.until.assign(n, 0.);
+		state.started.assign(n, false);
+		state.satisfied.assign(n, false);
+	}
+	state.capacity.resize(n);
+	for (size_t i = 0; i < n; i++)
+		state.capacity[i] = facility_buffer_capacity[factory->facility_toposort[item][i]];
+
+	state.dirty = true;
+}
+
+// calculates the flows for the current buffer levels
+void TimeSimulation::recalculate(item_t item)
+{
+	ItemState& state = items[item];
+	FlowGraph& flowgraph = state.flowgraph;
+
+	for (auto& edge : flowgraph.edges)
+	{
+		edge.actual_capacity = edge.capacity;
+		edge.actual_flow = 0;
+	}
+	for (size_t i = 0; i < flowgraph.nodes.size(); i++)
+	{
+		auto& node = flowgraph.nodes[i];
+		node.actual_production = 0;
+		node.excess = 0;
+
+		// enough to fill all outgoing edges and the own consumption
+		rate_t supply = max(rate_t(0), -node.max_production);
+		for (const auto* edge : node.outgoing_edges)
+			supply += edge->capacity;
+
+		node.supply = state.level[i] > 0. ? supply : 0;
+		node.absorb = state.level[i] < state.capacity[i] ? numeric_limits<rate_t>::max() : 0;
+	}
+
+	flowgraph.calculate();
+	recalculations++;
+
+	for (size_t i = 0; i < flowgraph.nodes.size(); i++)
+	{
+		const auto& node = flowgraph.nodes[i];
+		state.rate[i] = node.absorbed - node.drawn;
+
+		if (node.max_production < 0)
+		{
+			size_t facility = factory->facility_toposort[item][i];
+			if (!state.started[i] && node.actual_production < 0)
+			{
+				state.started[i] = true;
+				events.push_back(Event{now, Event::CONSUMER_STARTED, item, facility});
+			}
+			if (!state.satisfied[i] && node.actual_production <= node.max_production)
+			{
+				state.satisfied[i] = true;
+				events.push_back(Event{now, Event::CONSUMER_SATISFIED, item, facility});
+			}
+		}
+	}
+
+	state.dirty = false;
+}
+
+void TimeSimulation::schedule_facility_level(double time, size_t facility, size_t level)
+{
+	if (time < now || facility >= factory->facilities.size() || level >= factory->facilities[facility].levels())
+		throw runtime_error("invalid facility level change");
+	scheduled.emplace(time, LevelChange{false, facility, level});
+}
+
+void TimeSimulation::schedule_transport_level(double time, size_t transport_line, size_t level)
+{
+	if (time < now || transport_line >= factory->transport_lines.size() || level >= factory->transport_lines[transport_line].levels())
+		throw runtime_error("invalid transport line level change");
+	scheduled.emplace(time, LevelChange{true, transport_line, level});
+}
+
+void TimeSimulation::set_buffer(item_t item, size_t facility, double amount)
+{
+	if (!factory->facilities[facility].items.contains(item))
+		throw runtime_error("facility " + to_string(facility) + " has no buffer for item " + to_string(item));
+	ItemState& state = items[item];
+	size_t i = factory->facility_toposort_inv[item][facility];
+	state.level[i] = min(max(amount, 0.), state.capacity[i]);
+	state.dirty = true;
+}
+
+double TimeSimulation::buffer(item_t item, size_t facility) const
+{
+	if (!factory->facilities[facility].items.contains(item))
+		return 0.;
+	return items[item].level[factory->facility_toposort_inv[item][facility]];
+}
+
+double TimeSimulation::buffer_rate(item_t item, size_t facility)
+{
+	if (!factory->facilities[facility].items.contains(item))
+		return 0.;
+	if (items[item].dirty)
+		recalculate(item);
+	return items[item].rate[factory->facility_toposort_inv[item][facility]];
+}
+
+const FlowGraph& TimeSimulation::flow(item_t item)
+{
+	if (items[item].dirty)
+		recalculate(item);
+	return items[item].flowgraph;
+}
+
+void TimeSimulation::run_until(double t_end)
+{
+	if (t_end < now)
+		throw runtime_error("can't simulate backwards in time");
+
+	size_t n_nodes = 0;
+	for (const auto& state : items)
+		n_nodes += state.level.size();
+	size_t steps_without_progress = 0;
+
+	while (true)
+	{
+		for (int item = 0; item < MAX_ITEM; item++)
+			if (items[item].dirty)
+				recalculate(item_t(item));
+		if (now >= t_end)
+			break;
+
+		// the next buffer to become full or empty, or the next level change
+		double next = t_end;
+		for (auto& state : items)
+			for (size_t i = 0; i < state.level.size(); i++)
+			{
+				if (state.rate[i] > 0.)
+					state.until[i] = now + (state.capacity[i] - state.level[i]) / state.rate[i];
+				else if (state.rate[i] < 0.)
+					state.until[i] = now + state.level[i] / -state.rate[i];
+				else
+					continue;
+				next = min(next, state.until[i]);
+			}
+		if (!scheduled.empty())
+			next = min(next, scheduled.begin()->first);
+
+		if (next > now)
+			steps_without_progress = 0;
+		else if (++steps_without_progress > 2*n_nodes + scheduled.size() + 2)
+			throw runtime_error("time simulation is stuck at " + to_string(now) + "s");
+
+		// advance the buffers. the ones that got full or empty change the flows.
+		// this compares the times instead of the levels, so that rounding can't
+		// leave a buffer almost, but not quite full.
+		double dt = next - now;
+		now = next;
+		for (int item = 0; item < MAX_ITEM; item++)
+		{
+			ItemState& state = items[item];
+			for (size_t i = 0; i < state.level.size(); i++)
+			{
+				if (state.rate[i] == 0.)
+					continue;
+
+				size_t facility = factory->facility_toposort[item][i];
+				if (state.until[i] <= now)
+				{
+					bool full = state.rate[i] > 0.;
+					state.level[i] = full ? state.capacity[i] : 0.;
+					state.dirty = true;
+					events.push_back(Event{now, full ? Event::BUFFER_FULL : Event::BUFFER_EMPTY, item_t(item), facility});
+				}
+				else
+					state.level[i] = min(max(state.level[i] + state.rate[i] * dt, 0.), state.capacity[i]);
+			}
+		}
+
+		while (!scheduled.empty() && scheduled.begin()->first <= now)
+		{
+			LevelChange change = scheduled.begin()->second;
+			scheduled.erase(scheduled.begin());
+			if (change.is_transport_line)
+			{
+				conf.transport_levels[change.index] = change.level;
+				rebuild(factory->transport_lines[change.index].item_type);
+				events.push_back(Event{now, Event::TRANSPORT_LEVEL_CHANGED, DONE, change.index});
+			}
+			else
+			{
+				conf.facility_levels[change.index] = change.level;
+				for (item_t item : factory->facilities[change.index].items)
+					rebuild(item);
+				events.push_back(Event{now, Event::FACILITY_LEVEL_CHANGED, DONE, change.index});
+			}
+		}
+	}
+}
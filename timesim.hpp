@@ -0,0 +1,96 @@
+#pragma once
+#include <vector>
+#include <map>
+#include <cstddef>
+
+#include "factory.hpp"
+#include "flowgraph.hpp"
+
+// simulates a factory over time, with a buffer (a chest) at every facility.
+//
+// the flows are the same as in the steady state (FlowGraph::calculate()),
+// except that a buffer which isn't empty helps out when the facility gets
+// less than it consumes or could send on, and a buffer which isn't full
+// takes what the facility can neither consume nor send on, instead of
+// throttling it. so the flows only change when a buffer becomes full or
+// empty, or when the configuration is changed; the simulation jumps from
+// one such event to the next instead of advancing in fixed ticks. once all
+// buffers have settled, the consumers get what they get in the steady state,
+// though producers with full buffers may share the work differently. (the
+// fair splitter's rounding can keep a few buffers slowly trickling back and
+// forth by a unit per second forever.)
+//
+// every item has its own buffer at each facility. buffer levels and
+// capacities are in the units of the rates times seconds.
+struct TimeSimulation
+{
+	struct Event
+	{
+		enum Kind
+		{
+			BUFFER_FULL,
+			BUFFER_EMPTY,
+			CONSUMER_STARTED, // the facility began to consume the item
+			CONSUMER_SATISFIED, // the facility began to consume all it wants of the item
+			// a scheduled upgrade (or downgrade) took effect
+			FACILITY_LEVEL_CHANGED,
+			TRANSPORT_LEVEL_CHANGED
+		};
+
+		double time;
+		Kind kind;
+		item_t item; // DONE for level changes
+		size_t index; // the facility, or the transport line for TRANSPORT_LEVEL_CHANGED
+	};
+
+	// buffer_capacity[i] is the capacity of each of facilities[i]'s buffers.
+	// all buffers start empty.
+	TimeSimulation(const Factory* factory_, const Factory::FactoryConfiguration& conf_,
+		const std::vector<double>& buffer_capacity);
+
+	// changes a level at the given time, which must not be in the past
+	void schedule_facility_level(double time, size_t facility, size_t level);
+	void schedule_transport_level(double time, size_t transport_line, size_t level);
+
+	void set_buffer(item_t item, size_t facility, double amount); // clamped to the capacity
+	double buffer(item_t item, size_t facility) const;
+	double buffer_rate(item_t item, size_t facility); // currently, in units per second
+
+	// processes all events up to t_end and advances the time to it.
+	void run_until(double t_end);
+	double time() const { return now; }
+
+	// the current flows of the item, ordered like in Factory::build_flowgraph(item, conf)
+	const FlowGraph& flow(item_t item);
+
+	std::vector<Event> events; // all events so far, in order
+	size_t recalculations = 0; // how often an item's flows were calculated
+
+	private:
+		struct ItemState
+		{
+			FlowGraph flowgraph;
+			std::vector<double> level, capacity; // per node
+			std::vector<double> rate; // per node, valid if !dirty
+			std::vector<double> until; // per node, when it gets full or empty at the current rate
+			std::vector<bool> started, satisfied; // per node
+			bool dirty = true;
+		};
+
+		struct LevelChange
+		{
+			bool is_transport_line;
+			size_t index;
+			size_t level;
+		};
+
+		const Factory* factory;
+		Factory::FactoryConfiguration conf;
+		std::vector<double> facility_buffer_capacity;
+		std::vector<ItemState> items;
+		std::multimap<double, LevelChange> scheduled;
+		double now = 0.;
+
+		void rebuild(item_t item);
+		void recalculate(item_t item);
+};